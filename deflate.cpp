@@ -0,0 +1,746 @@
+#include "deflate.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace libeye {
+
+// ------------------------------------------------------
+// Output
+
+void out_reserve(deflate_out &out, size_t more) {
+	if (out.size + more <= out.cap) return;
+	
+	size_t cap = out.cap ? out.cap : 4096;
+	while (cap < out.size + more) cap *= 2;
+	
+	out.data = (unsigned char*) realloc(out.data, cap);
+	out.cap  = cap;
+}
+
+// Deflate packs bits from the least significant end
+struct bit_writer {
+	deflate_out *out;
+	
+	uint64_t bits;
+	int count;
+};
+
+static inline void put_bits(bit_writer &w, uint32_t value, int n) {
+	w.bits  |= (uint64_t) value << w.count;
+	w.count += n;
+	
+	if (w.count < 32) return;
+	
+	out_reserve(*w.out, 8);
+	
+	while (w.count >= 8) {
+		w.out->data[w.out->size++] = (unsigned char) w.bits;
+		w.bits  >>= 8;
+		w.count  -= 8;
+	}
+}
+
+static void flush_bits(bit_writer &w) {
+	out_reserve(*w.out, 8);
+	
+	while (w.count > 0) {
+		w.out->data[w.out->size++] = (unsigned char) w.bits;
+		w.bits  >>= 8;
+		w.count  -= 8;
+	}
+	
+	w.bits  = 0;
+	w.count = 0;
+}
+
+// ------------------------------------------------------
+// Code tables
+
+static const uint16_t length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577
+};
+
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Order of the code length code lengths in a block header
+static const uint8_t length_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static inline int top_bit(uint32_t v) {
+	return 31 - __builtin_clz(v);
+}
+
+// Index into length_base for a match length of 3..258
+static inline int length_code(int len) {
+	int l = len - 3;
+	
+	if (l < 8)    return l;
+	if (l == 255) return 28;
+	
+	int b = top_bit(l);
+	return 4*(b-1) + ((l >> (b-2)) & 3);
+}
+
+// Index into dist_base for a distance of 1..32768
+static inline int dist_code(int dist) {
+	int d = dist - 1;
+	
+	if (d < 4) return d;
+	
+	int b = top_bit(d);
+	return 2*b + ((d >> (b-1)) & 1);
+}
+
+// ------------------------------------------------------
+// Huffman codes
+
+enum {
+	LITLEN_CODES = 286,
+	DIST_CODES   = 30,
+	CL_CODES     = 19,
+	
+	// The fixed code also assigns the unused 286 and 287
+	FIXED_CODES  = 288
+};
+
+struct huffman {
+	uint8_t  len[FIXED_CODES];
+	uint16_t code[FIXED_CODES];     // bit reversed, ready to put
+};
+
+static void sort_by_freq(const uint32_t *freq, int *syms, int n) {
+	int i, j;
+	
+	// Insertion sort; at most 286 symbols, mostly in order
+	for (i=1; i<n; i++) {
+		int s = syms[i];
+		
+		for (j=i; j>0 && freq[syms[j-1]] > freq[s]; j--) {
+			syms[j] = syms[j-1];
+		}
+		
+		syms[j] = s;
+	}
+}
+
+// Code lengths of at most limit bits for the n symbols
+static void build_lengths(const uint32_t *freq, int n, int limit,
+	uint8_t *len)
+{
+	int i;
+	int syms[LITLEN_CODES];
+	int m = 0;
+	
+	for (i=0; i<n; i++) {
+		len[i] = 0;
+		if (freq[i] > 0) syms[m++] = i;
+	}
+	
+	if (m == 0) return;
+	
+	if (m == 1) {
+		len[syms[0]] = 1;
+		return;
+	}
+	
+	sort_by_freq(freq, syms, m);
+	
+	// Two-queue Huffman: leaves in increasing frequency, and
+	// internal nodes, which are made in increasing weight.
+	// Nodes 0..m-1 are leaves, m.. internal.
+	uint32_t weight[2*LITLEN_CODES];
+	int parent[2*LITLEN_CODES];
+	int depth[2*LITLEN_CODES];
+	
+	for (i=0; i<m; i++) weight[i] = freq[syms[i]];
+	
+	int leaf = 0, node = m, made = m;
+	
+	for (; made < 2*m - 1; made++) {
+		int pick[2];
+		
+		for (i=0; i<2; i++) {
+			if (leaf < m && (node == made || weight[leaf] <= weight[node]))
+				pick[i] = leaf++;
+			else
+				pick[i] = node++;
+		}
+		
+		weight[made] = weight[pick[0]] + weight[pick[1]];
+		parent[pick[0]] = made;
+		parent[pick[1]] = made;
+	}
+	
+	depth[2*m - 2] = 0;
+	
+	for (i=2*m-3; i>=0; i--) {
+		depth[i] = depth[parent[i]] + 1;
+	}
+	
+	// Limit the lengths, keeping the code complete: fold
+	// long codes into the longest allowed length, then move
+	// codes down from shorter lengths until it fits.
+	int count[32];
+	
+	memset(count, 0, sizeof(count));
+	
+	for (i=0; i<m; i++) {
+		count[depth[i] > limit ? limit : depth[i]]++;
+	}
+	
+	uint32_t total = 0;
+	
+	for (i=1; i<=limit; i++) {
+		total += (uint32_t) count[i] << (limit - i);
+	}
+	
+	while (total > (1U << limit)) {
+		count[limit]--;
+		
+		for (i=limit-1; i>0; i--) {
+			if (count[i] > 0) {
+				count[i]--;
+				count[i+1] += 2;
+				break;
+			}
+		}
+		
+		total--;
+	}
+	
+	// Rarest symbols get the longest codes
+	int l = limit;
+	
+	for (i=0; i<m; i++) {
+		while (count[l] == 0) l--;
+		
+		len[syms[i]] = l;
+		count[l]--;
+	}
+}
+
+static void build_codes(huffman &h, int n) {
+	int i, b;
+	int count[16];
+	int next[16];
+	
+	memset(count, 0, sizeof(count));
+	
+	for (i=0; i<n; i++) count[h.len[i]]++;
+	count[0] = 0;
+	
+	int code = 0;
+	
+	for (b=1; b<16; b++) {
+		code = (code + count[b-1]) << 1;
+		next[b] = code;
+	}
+	
+	for (i=0; i<n; i++) {
+		int l = h.len[i];
+		if (l == 0) continue;
+		
+		int c = next[l]++;
+		int r = 0;
+		
+		for (b=0; b<l; b++) {
+			r = (r << 1) | (c & 1);
+			c >>= 1;
+		}
+		
+		h.code[i] = r;
+	}
+}
+
+static void fixed_codes(huffman &lit, huffman &dist) {
+	int i;
+	
+	for (i=0;   i<144; i++) lit.len[i] = 8;
+	for (i=144; i<256; i++) lit.len[i] = 9;
+	for (i=256; i<280; i++) lit.len[i] = 7;
+	for (i=280; i<FIXED_CODES; i++) lit.len[i] = 8;
+	
+	for (i=0; i<DIST_CODES; i++) dist.len[i] = 5;
+	
+	build_codes(lit, FIXED_CODES);
+	build_codes(dist, DIST_CODES);
+}
+
+// ------------------------------------------------------
+// Blocks
+
+// A literal (dist 0) or a match
+struct token {
+	uint16_t value;
+	uint16_t dist;
+};
+
+// Run-length coded code lengths for a dynamic block header
+struct block_header {
+	int hlit;
+	int hdist;
+	int hclen;
+	
+	int nsyms;
+	uint8_t syms[LITLEN_CODES + DIST_CODES];
+	uint8_t extra[LITLEN_CODES + DIST_CODES];
+	
+	huffman cl;
+};
+
+static void rle_lengths(block_header &hdr, const uint8_t *lens, int n) {
+	int i = 0;
+	
+	hdr.nsyms = 0;
+	
+	while (i < n) {
+		int l = lens[i];
+		int run = 1;
+		
+		while (i + run < n && lens[i + run] == l) run++;
+		
+		i += run;
+		
+		if (l == 0) {
+			while (run >= 11) {
+				int r = run > 138 ? 138 : run;
+				hdr.syms[hdr.nsyms]  = 18;
+				hdr.extra[hdr.nsyms++] = r - 11;
+				run -= r;
+			}
+			
+			if (run >= 3) {
+				hdr.syms[hdr.nsyms]  = 17;
+				hdr.extra[hdr.nsyms++] = run - 3;
+				run = 0;
+			}
+		}
+		else {
+			hdr.syms[hdr.nsyms]  = l;
+			hdr.extra[hdr.nsyms++] = 0;
+			run--;
+			
+			while (run >= 3) {
+				int r = run > 6 ? 6 : run;
+				hdr.syms[hdr.nsyms]  = 16;
+				hdr.extra[hdr.nsyms++] = r - 3;
+				run -= r;
+			}
+		}
+		
+		for (; run > 0; run--) {
+			hdr.syms[hdr.nsyms]  = l;
+			hdr.extra[hdr.nsyms++] = 0;
+		}
+	}
+}
+
+// Bits of a dynamic header for lit and dist
+static long dynamic_header(block_header &hdr,
+	const huffman &lit, const huffman &dist)
+{
+	int i;
+	uint8_t lens[LITLEN_CODES + DIST_CODES];
+	uint32_t freq[CL_CODES];
+	
+	hdr.hlit = LITLEN_CODES;
+	while (hdr.hlit > 257 && lit.len[hdr.hlit - 1] == 0) hdr.hlit--;
+	
+	hdr.hdist = DIST_CODES;
+	while (hdr.hdist > 1 && dist.len[hdr.hdist - 1] == 0) hdr.hdist--;
+	
+	memcpy(lens, lit.len, hdr.hlit);
+	memcpy(lens + hdr.hlit, dist.len, hdr.hdist);
+	
+	rle_lengths(hdr, lens, hdr.hlit + hdr.hdist);
+	
+	memset(freq, 0, sizeof(freq));
+	for (i=0; i<hdr.nsyms; i++) freq[hdr.syms[i]]++;
+	
+	build_lengths(freq, CL_CODES, 7, hdr.cl.len);
+	build_codes(hdr.cl, CL_CODES);
+	
+	hdr.hclen = CL_CODES;
+	while (hdr.hclen > 4 && hdr.cl.len[length_order[hdr.hclen - 1]] == 0)
+		hdr.hclen--;
+	
+	long bits = 5 + 5 + 4 + 3*hdr.hclen;
+	
+	for (i=0; i<hdr.nsyms; i++) {
+		int s = hdr.syms[i];
+		bits += hdr.cl.len[s] + (s == 16 ? 2 : s == 17 ? 3 : s == 18 ? 7 : 0);
+	}
+	
+	return bits;
+}
+
+static void put_header(bit_writer &w, const block_header &hdr) {
+	int i;
+	
+	put_bits(w, hdr.hlit - 257, 5);
+	put_bits(w, hdr.hdist - 1, 5);
+	put_bits(w, hdr.hclen - 4, 4);
+	
+	for (i=0; i<hdr.hclen; i++) {
+		put_bits(w, hdr.cl.len[length_order[i]], 3);
+	}
+	
+	for (i=0; i<hdr.nsyms; i++) {
+		int s = hdr.syms[i];
+		
+		put_bits(w, hdr.cl.code[s], hdr.cl.len[s]);
+		
+		if      (s == 16) put_bits(w, hdr.extra[i], 2);
+		else if (s == 17) put_bits(w, hdr.extra[i], 3);
+		else if (s == 18) put_bits(w, hdr.extra[i], 7);
+	}
+}
+
+// Bits for the tokens under lit and dist, without a header
+static long token_bits(const uint32_t *lfreq, const uint32_t *dfreq,
+	const huffman &lit, const huffman &dist)
+{
+	int i;
+	long bits = 0;
+	
+	for (i=0; i<LITLEN_CODES; i++) {
+		if (lfreq[i] == 0) continue;
+		
+		bits += (long) lfreq[i] * (lit.len[i] + (i > 256 ? length_extra[i - 257] : 0));
+	}
+	
+	for (i=0; i<DIST_CODES; i++) {
+		bits += (long) dfreq[i] * (dist.len[i] + dist_extra[i]);
+	}
+	
+	return bits;
+}
+
+static void put_tokens(bit_writer &w, const token *tokens, int n,
+	const huffman &lit, const huffman &dist)
+{
+	int i;
+	
+	for (i=0; i<n; i++) {
+		const token &t = tokens[i];
+		
+		if (t.dist == 0) {
+			put_bits(w, lit.code[t.value], lit.len[t.value]);
+			continue;
+		}
+		
+		int lc = length_code(t.value);
+		int dc = dist_code(t.dist);
+		
+		put_bits(w, lit.code[257 + lc], lit.len[257 + lc]);
+		put_bits(w, t.value - length_base[lc], length_extra[lc]);
+		
+		put_bits(w, dist.code[dc], dist.len[dc]);
+		put_bits(w, t.dist - dist_base[dc], dist_extra[dc]);
+	}
+	
+	put_bits(w, lit.code[256], lit.len[256]);
+}
+
+static void put_stored(bit_writer &w, const unsigned char *data, size_t size) {
+	do {
+		size_t n = size > 65535 ? 65535 : size;
+		
+		put_bits(w, 0, 3);
+		flush_bits(w);
+		
+		out_reserve(*w.out, 4 + n);
+		
+		unsigned char *p = w.out->data + w.out->size;
+		
+		p[0] = (unsigned char) n;
+		p[1] = (unsigned char) (n >> 8);
+		p[2] = (unsigned char) ~n;
+		p[3] = (unsigned char) (~n >> 8);
+		
+		memcpy(p + 4, data, n);
+		w.out->size += 4 + n;
+		
+		data += n;
+		size -= n;
+	} while (size > 0);
+}
+
+// Writes tokens covering data[0, size) as whichever of a
+// stored, fixed or dynamic block is smallest
+static void put_block(bit_writer &w, const token *tokens, int n,
+	const unsigned char *data, size_t size)
+{
+	int i;
+	uint32_t lfreq[LITLEN_CODES];
+	uint32_t dfreq[DIST_CODES];
+	
+	memset(lfreq, 0, sizeof(lfreq));
+	memset(dfreq, 0, sizeof(dfreq));
+	
+	for (i=0; i<n; i++) {
+		if (tokens[i].dist == 0) {
+			lfreq[tokens[i].value]++;
+		}
+		else {
+			lfreq[257 + length_code(tokens[i].value)]++;
+			dfreq[dist_code(tokens[i].dist)]++;
+		}
+	}
+	
+	lfreq[256] = 1;
+	
+	huffman lit, dist;
+	huffman flit, fdist;
+	block_header hdr;
+	
+	build_lengths(lfreq, LITLEN_CODES, 15, lit.len);
+	build_lengths(dfreq, DIST_CODES, 15, dist.len);
+	
+	// A distance code must exist even if unused
+	bool any = false;
+	
+	for (i=0; i<DIST_CODES; i++) {
+		if (dist.len[i] != 0) any = true;
+	}
+	
+	if (!any) dist.len[0] = 1;
+	
+	build_codes(lit, LITLEN_CODES);
+	build_codes(dist, DIST_CODES);
+	
+	fixed_codes(flit, fdist);
+	
+	long dynamic_cost = dynamic_header(hdr, lit, dist)
+		+ token_bits(lfreq, dfreq, lit, dist);
+	long fixed_cost   = token_bits(lfreq, dfreq, flit, fdist);
+	long stored_cost  = 8 * ((long) size + 5 * ((long) size / 65535 + 1)) + 7;
+	
+	if (stored_cost <= dynamic_cost && stored_cost <= fixed_cost) {
+		put_stored(w, data, size);
+	}
+	else if (fixed_cost <= dynamic_cost) {
+		put_bits(w, 1 << 1, 3);
+		put_tokens(w, tokens, n, flit, fdist);
+	}
+	else {
+		put_bits(w, 2 << 1, 3);
+		put_header(w, hdr);
+		put_tokens(w, tokens, n, lit, dist);
+	}
+}
+
+// ------------------------------------------------------
+// LZ77
+
+enum {
+	WINDOW     = 32768,
+	HASH_BITS  = 15,
+	MAX_MATCH  = 258,
+	MAX_CHAIN  = 32,
+	NICE_MATCH = 128,
+	
+	// Tokens per block
+	BLOCK_TOKENS = 1 << 14
+};
+
+static inline uint32_t hash3(const unsigned char *p) {
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+	
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+void deflate_sync(const unsigned char *data, size_t size,
+	deflate_out &out)
+{
+	size_t i, j;
+	
+	bit_writer w;
+	
+	w.out   = &out;
+	w.bits  = 0;
+	w.count = 0;
+	
+	int *head = new int[1 << HASH_BITS];
+	int *prev = new int[WINDOW];
+	token *tokens = new token[BLOCK_TOKENS];
+	
+	for (i=0; i<(1 << HASH_BITS); i++) head[i] = -1;
+	
+	int ntokens = 0;
+	size_t block_start = 0;
+	
+	i = 0;
+	
+	while (i < size) {
+		int best = 0, best_dist = 0;
+		
+		if (i + 3 <= size) {
+			uint32_t h = hash3(data + i);
+			int cand  = head[h];
+			int chain = MAX_CHAIN;
+			int most  = size - i < MAX_MATCH ? (int) (size - i) : MAX_MATCH;
+			
+			while (cand >= 0 && (int) i - cand <= WINDOW && chain-- > 0) {
+				const unsigned char *a = data + cand;
+				const unsigned char *b = data + i;
+				
+				if (a[best] == b[best]) {
+					int l = 0;
+					while (l < most && a[l] == b[l]) l++;
+					
+					if (l > best) {
+						best = l;
+						best_dist = (int) i - cand;
+						
+						if (best >= NICE_MATCH || best == most) break;
+					}
+				}
+				
+				int next = prev[cand & (WINDOW-1)];
+				if (next >= cand) break;
+				
+				cand = next;
+			}
+			
+			prev[i & (WINDOW-1)] = head[h];
+			head[h] = (int) i;
+		}
+		
+		if (best >= 3) {
+			tokens[ntokens].value = best;
+			tokens[ntokens].dist  = best_dist;
+			ntokens++;
+			
+			// Index the covered positions too, except in
+			// long runs where it costs more than it finds
+			size_t end = i + best;
+			
+			if (best <= 32) {
+				for (j=i+1; j<end && j+3<=size; j++) {
+					uint32_t h = hash3(data + j);
+					prev[j & (WINDOW-1)] = head[h];
+					head[h] = (int) j;
+				}
+			}
+			
+			i = end;
+		}
+		else {
+			tokens[ntokens].value = data[i];
+			tokens[ntokens].dist  = 0;
+			ntokens++;
+			i++;
+		}
+		
+		if (ntokens == BLOCK_TOKENS) {
+			put_block(w, tokens, ntokens, data + block_start, i - block_start);
+			
+			ntokens = 0;
+			block_start = i;
+		}
+	}
+	
+	if (ntokens > 0) {
+		put_block(w, tokens, ntokens, data + block_start, i - block_start);
+	}
+	
+	// Sync flush: an empty stored block
+	put_stored(w, data, 0);
+	
+	delete[] head;
+	delete[] prev;
+	delete[] tokens;
+}
+
+// ------------------------------------------------------
+// Checksums
+
+uint32_t adler32(uint32_t adler, const unsigned char *data, size_t size) {
+	uint32_t a = adler & 0xffff;
+	uint32_t b = adler >> 16;
+	
+	while (size > 0) {
+		// Largest run before b can overflow
+		size_t n = size < 5552 ? size : 5552;
+		size -= n;
+		
+		for (; n > 0; n--) {
+			a += *data++;
+			b += a;
+		}
+		
+		a %= 65521;
+		b %= 65521;
+	}
+	
+	return a | (b << 16);
+}
+
+uint32_t adler32_combine(uint32_t first, uint32_t second,
+	size_t second_size)
+{
+	const uint32_t base = 65521;
+	
+	uint32_t rem = second_size % base;
+	uint32_t a1  = first & 0xffff;
+	
+	uint32_t a = a1 + (second & 0xffff) + base - 1;
+	uint32_t b = (uint32_t) (((uint64_t) rem * a1) % base)
+		+ (first >> 16) + (second >> 16) + base - rem;
+	
+	a %= base;
+	b %= base;
+	
+	return a | (b << 16);
+}
+
+static uint32_t crc_table[256];
+
+// Filled when the library loads
+static struct crc_table_init {
+	crc_table_init() {
+		uint32_t n, k;
+		
+		for (n=0; n<256; n++) {
+			uint32_t c = n;
+			
+			for (k=0; k<8; k++) {
+				c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+			}
+			
+			crc_table[n] = c;
+		}
+	}
+} crc_table_init_now;
+
+uint32_t crc32(uint32_t crc, const unsigned char *data, size_t size) {
+	crc = ~crc;
+	
+	for (; size > 0; size--) {
+		crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	}
+	
+	return ~crc;
+}
+
+// ------------------------------------------------------
+
+} /* namespace libeye */
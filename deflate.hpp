@@ -0,0 +1,40 @@
+#ifndef _libeye_deflate_hpp
+#define _libeye_deflate_hpp 1
+
+// Deflate, Adler-32 and CRC-32 for the PNG writer.
+//
+// Internal header; not installed.
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace libeye {
+
+// Grows with realloc; the owner frees data.
+struct deflate_out {
+	unsigned char *data;
+	size_t size;
+	size_t cap;
+};
+
+void out_reserve(deflate_out &out, size_t more);
+
+// Appends data as non-final deflate blocks followed by a sync
+// flush, so the output ends on a byte boundary and outputs for
+// consecutive pieces of a stream can be concatenated. Matches
+// do not reach back before data, so pieces can be compressed
+// in parallel.
+void deflate_sync(const unsigned char *data, size_t size,
+	deflate_out &out);
+
+uint32_t adler32(uint32_t adler, const unsigned char *data, size_t size);
+
+// Adler-32 of the concatenation, given that of each piece
+uint32_t adler32_combine(uint32_t first, uint32_t second,
+	size_t second_size);
+
+uint32_t crc32(uint32_t crc, const unsigned char *data, size_t size);
+
+} /* namespace libeye */
+
+#endif /* defined _libeye_deflate_hpp */
@@ -0,0 +1,180 @@
+#include "libeye.hpp"
+
+#include "parallel.hpp"
+#include <cmath>
+
+namespace libeye {
+
+// ------------------------------------------------------
+// DisparityTable
+
+struct scale_job {
+	const View *view;
+	double shift;
+	float *scale;
+};
+
+static void scale_rows(void *arg, int begin, int end) {
+	scale_job *job = (scale_job*) arg;
+	int x, y;
+	
+	const View &view = *job->view;
+	
+	point3 base = view.screen.origin - view.eye;
+	const point3 &e1 = view.screen.e1;
+	const point3 &e2 = view.screen.e2;
+	
+	for (y=begin; y<end; y++) {
+		float *row = job->scale + y * view.width;
+		
+		for (x=0; x<view.width; x++) {
+			double rx = base.x() + x*e1.x() + y*e2.x();
+			double ry = base.y() + x*e1.y() + y*e2.y();
+			double rz = base.z() + x*e1.z() + y*e2.z();
+			
+			row[x] = (float) (job->shift * sqrt(rx*rx + ry*ry + rz*rz));
+		}
+	}
+}
+
+DisparityTable::DisparityTable(const BiView &biview) {
+	scale_job job;
+	
+	this->width     = biview.width;
+	this->height    = biview.height;
+	this->eye_back  = biview.eye_back;
+	this->left_eye  = biview.left.eye;
+	this->right_eye = biview.right.eye;
+	this->screen    = biview.left.screen;
+	
+	double sx = screen.e1.x();
+	
+	left_shift  = (right_eye.x() - left_eye.x()) / sx;
+	right_shift = (left_eye.x() - right_eye.x()) / sx;
+	
+	left_scale  = new float[width * height];
+	right_scale = new float[width * height];
+	
+	job.view  = &biview.left;
+	job.shift = left_shift;
+	job.scale = left_scale;
+	parallel_for(height, scale_rows, &job);
+	
+	job.view  = &biview.right;
+	job.shift = right_shift;
+	job.scale = right_scale;
+	parallel_for(height, scale_rows, &job);
+}
+
+DisparityTable::~DisparityTable() {
+	delete[] left_scale;
+	delete[] right_scale;
+}
+
+bool DisparityTable::matches(const BiView &biview) const {
+	const Screen &s = biview.left.screen;
+	
+	return width == biview.width
+		&& height == biview.height
+		&& eye_back == biview.eye_back
+		&& left_eye.x()  == biview.left.eye.x()
+		&& right_eye.x() == biview.right.eye.x()
+		&& screen.origin.x() == s.origin.x()
+		&& screen.origin.y() == s.origin.y()
+		&& screen.e1.x() == s.e1.x()
+		&& screen.e2.y() == s.e2.y();
+}
+
+// ------------------------------------------------------
+// StereoBlank through a DisparityTable
+
+struct link_job {
+	const View *view;
+	const DisparityTable *table;
+	
+	double shift;
+	const float *scale;
+	
+	Rect r;
+	int *out;
+};
+
+static void link_rows(void *arg, int begin, int end) {
+	link_job *job = (link_job*) arg;
+	int x, y;
+	
+	const View &view = *job->view;
+	const Rect &r = job->r;
+	
+	double shift = job->shift;
+	double k     = shift * job->table->eye_back;
+	
+	for (y=r.y0+begin; y<r.y0+end; y++) {
+		const double *depth = view.buffer + y * view.width;
+		const float  *scale = job->scale + y * view.width;
+		int          *out   = job->out + y * view.width;
+		
+		if (view.depth_mode == DEPTH_INVERSE_Z) {
+			for (x=r.x0; x<=r.x1; x++) {
+				out[x] = (int) (x + shift - k * depth[x]);
+			}
+		}
+		else {
+			for (x=r.x0; x<=r.x1; x++) {
+				out[x] = (int) (x + shift - scale[x] / depth[x]);
+			}
+		}
+	}
+}
+
+static void link_view(const View &view, const DisparityTable &table,
+	double shift, const float *scale, const Rect &area, int *out)
+{
+	link_job job;
+	
+	job.view  = &view;
+	job.table = &table;
+	job.shift = shift;
+	job.scale = scale;
+	job.r     = area.clip(view.width, view.height);
+	job.out   = out;
+	
+	if (job.r.empty()) return;
+	
+	parallel_for(job.r.y1 - job.r.y0 + 1, link_rows, &job);
+}
+
+StereoBlank::StereoBlank(const BiView &biview,
+	const DisparityTable &table)
+{
+	this->width  = biview.right.width;
+	this->height = biview.right.height;
+	
+	allocate();
+	
+	Rect all(0, 0, width-1, height-1);
+	
+	set(biview, table, all, all);
+}
+
+void StereoBlank::set(const BiView &biview, const DisparityTable &table,
+	const Rect &left_area, const Rect &right_area)
+{
+	expand();
+	
+	link_view(biview.left, table, table.left_shift,
+		table.left_scale, left_area, right_pair_buffer);
+	
+	link_view(biview.right, table, table.right_shift,
+		table.right_scale, right_area, left_pair_buffer);
+}
+
+void StereoBlank::update(const BiView &biview,
+	const DisparityTable &table)
+{
+	set(biview, table, biview.left.changed(), biview.right.changed());
+}
+
+// ------------------------------------------------------
+
+} /* namespace libeye */
@@ -0,0 +1,525 @@
+#include "libeye.hpp"
+
+#include "parallel.hpp"
+#include "deflate.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace libeye {
+
+// ------------------------------------------------------
+// Image output
+//
+// Netpbm rows are written as they come. PNG rows are gathered
+// into one block per worker; when every block is full they are
+// filtered and deflated in parallel, each into an IDAT chunk
+// of its own ending in a sync flush, and written in order. The
+// stream's Adler-32 is combined from the blocks'. Filters look
+// at the row above, so each block keeps a copy of the last row
+// of the block before it.
+
+// Raw bytes per PNG block
+static const size_t png_block_size = 1 << 18;
+
+struct png_block {
+	unsigned char *raw;
+	unsigned char *prior;   // row above the first
+	int rows;
+	
+	unsigned char *filtered;
+	size_t filtered_size;
+	uint32_t adler;
+	
+	// Whole IDAT chunk
+	deflate_out out;
+};
+
+struct image_state {
+	FILE *file;
+	
+	ImageFormat format;
+	
+	int width;
+	int height;
+	int channels;
+	int bits;
+	
+	size_t row_bytes;
+	int rows;
+	bool ok;
+	
+	unsigned char *row;     // big-endian copy of a row
+	unsigned char *rgb;     // for write_rgb
+	
+	// PNG
+	int bpp;                // bytes per pixel, for filters
+	int block_rows;
+	int nblocks;
+	int current;
+	png_block *blocks;
+	uint32_t adler;
+};
+
+static inline void put_u32(unsigned char *p, uint32_t v) {
+	p[0] = (unsigned char) (v >> 24);
+	p[1] = (unsigned char) (v >> 16);
+	p[2] = (unsigned char) (v >> 8);
+	p[3] = (unsigned char) v;
+}
+
+static bool put_chunk(FILE *f, const char *type,
+	const unsigned char *data, size_t size)
+{
+	unsigned char head[8];
+	unsigned char tail[4];
+	
+	put_u32(head, (uint32_t) size);
+	memcpy(head + 4, type, 4);
+	
+	put_u32(tail, crc32(crc32(0, head + 4, 4), data, size));
+	
+	return fwrite(head, 8, 1, f) == 1
+		&& (size == 0 || fwrite(data, size, 1, f) == 1)
+		&& fwrite(tail, 4, 1, f) == 1;
+}
+
+// Samples to the big-endian order of every format here
+static void convert_row(const image_state *s,
+	const unsigned char *src, unsigned char *dst)
+{
+	size_t i;
+	
+	if (s->bits == 8) {
+		memcpy(dst, src, s->row_bytes);
+		return;
+	}
+	
+	for (i=0; i<s->row_bytes; i+=2) {
+		uint16_t v;
+		memcpy(&v, src + i, 2);
+		
+		dst[i]   = (unsigned char) (v >> 8);
+		dst[i+1] = (unsigned char) v;
+	}
+}
+
+// ----------------
+// PNG filtering
+
+static inline int paeth(int a, int b, int c) {
+	int p  = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	
+	if (pa <= pb && pa <= pc) return a;
+	if (pb <= pc)             return b;
+	return c;
+}
+
+// Tries every filter and keeps the one with the smallest sum
+// of absolute differences, the usual heuristic
+static void filter_row(const unsigned char *row, const unsigned char *up,
+	size_t n, int bpp, unsigned char *out, unsigned char *scratch)
+{
+	size_t i;
+	int f;
+	
+	unsigned char *cand[5];
+	long cost[5];
+	
+	for (f=0; f<5; f++) {
+		cand[f] = scratch + f*n;
+		cost[f] = 0;
+	}
+	
+	for (i=0; i<n; i++) {
+		int a = i >= (size_t) bpp ? row[i - bpp] : 0;
+		int b = up[i];
+		int c = i >= (size_t) bpp ? up[i - bpp] : 0;
+		int x = row[i];
+		
+		cand[0][i] = (unsigned char) x;
+		cand[1][i] = (unsigned char) (x - a);
+		cand[2][i] = (unsigned char) (x - b);
+		cand[3][i] = (unsigned char) (x - ((a + b) >> 1));
+		cand[4][i] = (unsigned char) (x - paeth(a, b, c));
+		
+		for (f=0; f<5; f++) {
+			cost[f] += abs((signed char) cand[f][i]);
+		}
+	}
+	
+	int best = 0;
+	
+	for (f=1; f<5; f++) {
+		if (cost[f] < cost[best]) best = f;
+	}
+	
+	out[0] = (unsigned char) best;
+	memcpy(out + 1, cand[best], n);
+}
+
+static void png_compress(void *arg, int begin, int end) {
+	image_state *s = (image_state*) arg;
+	int i, r;
+	
+	size_t n = s->row_bytes;
+	unsigned char *scratch = new unsigned char[5 * n];
+	
+	for (i=begin; i<end; i++) {
+		png_block &b = s->blocks[i];
+		
+		for (r=0; r<b.rows; r++) {
+			const unsigned char *up = r > 0 ? b.raw + (r-1)*n : b.prior;
+			
+			filter_row(b.raw + r*n, up, n, s->bpp,
+				b.filtered + r*(n+1), scratch);
+		}
+		
+		b.filtered_size = b.rows * (n+1);
+		b.adler = adler32(1, b.filtered, b.filtered_size);
+		
+		// Chunk length and type go in front
+		b.out.size = 0;
+		out_reserve(b.out, 8);
+		b.out.size = 8;
+		
+		deflate_sync(b.filtered, b.filtered_size, b.out);
+		
+		put_u32(b.out.data, (uint32_t) (b.out.size - 8));
+		memcpy(b.out.data + 4, "IDAT", 4);
+		
+		uint32_t crc = crc32(0, b.out.data + 4, b.out.size - 4);
+		
+		out_reserve(b.out, 4);
+		put_u32(b.out.data + b.out.size, crc);
+		b.out.size += 4;
+	}
+	
+	delete[] scratch;
+}
+
+// Compresses and writes the first count blocks
+static void png_flush(image_state *s, int count) {
+	int i;
+	
+	parallel_for(count, png_compress, s);
+	
+	for (i=0; i<count; i++) {
+		png_block &b = s->blocks[i];
+		
+		if (fwrite(b.out.data, 1, b.out.size, s->file) != b.out.size)
+			s->ok = false;
+		
+		s->adler = adler32_combine(s->adler, b.adler, b.filtered_size);
+		b.rows = 0;
+	}
+	
+	s->current = 0;
+}
+
+static void png_add_row(image_state *s, const unsigned char *src) {
+	size_t n = s->row_bytes;
+	png_block &b = s->blocks[s->current];
+	
+	convert_row(s, src, b.raw + b.rows*n);
+	b.rows++;
+	
+	if (b.rows < s->block_rows) return;
+	
+	s->current++;
+	if (s->current == s->nblocks) png_flush(s, s->nblocks);
+	
+	// The raw rows outlive the flush
+	memcpy(s->blocks[s->current].prior, b.raw + (s->block_rows-1)*n, n);
+}
+
+// ----------------
+// Headers
+
+static bool png_start(image_state *s) {
+	int i;
+	
+	static const unsigned char signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+	
+	static const unsigned char colour_type[5] = { 0, 0, 4, 2, 6 };
+	
+	unsigned char ihdr[13];
+	
+	put_u32(ihdr, s->width);
+	put_u32(ihdr + 4, s->height);
+	
+	ihdr[8]  = s->bits;
+	ihdr[9]  = colour_type[s->channels];
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = 0;
+	
+	// The zlib header goes in an IDAT of its own
+	static const unsigned char zlib_header[2] = { 0x78, 0x01 };
+	
+	s->bpp = s->channels * s->bits / 8;
+	
+	s->block_rows = png_block_size / s->row_bytes;
+	if (s->block_rows < 1) s->block_rows = 1;
+	
+	s->nblocks = worker_count();
+	s->current = 0;
+	s->adler   = 1;
+	s->blocks  = new png_block[s->nblocks];
+	
+	for (i=0; i<s->nblocks; i++) {
+		png_block &b = s->blocks[i];
+		
+		b.raw      = new unsigned char[s->block_rows * s->row_bytes];
+		b.prior    = new unsigned char[s->row_bytes];
+		b.filtered = new unsigned char[s->block_rows * (s->row_bytes + 1)];
+		b.rows     = 0;
+		
+		memset(b.prior, 0, s->row_bytes);
+		
+		b.out.data = 0;
+		b.out.size = 0;
+		b.out.cap  = 0;
+	}
+	
+	return fwrite(signature, 8, 1, s->file) == 1
+		&& put_chunk(s->file, "IHDR", ihdr, sizeof(ihdr))
+		&& put_chunk(s->file, "IDAT", zlib_header, sizeof(zlib_header));
+}
+
+static bool png_finish(image_state *s) {
+	if (s->current < s->nblocks && s->blocks[s->current].rows > 0)
+		s->current++;
+	
+	png_flush(s, s->current);
+	
+	// Final empty fixed block, then the checksum
+	unsigned char tail[6] = { 0x03, 0x00 };
+	put_u32(tail + 2, s->adler);
+	
+	return put_chunk(s->file, "IDAT", tail, sizeof(tail))
+		&& put_chunk(s->file, "IEND", 0, 0);
+}
+
+static bool netpbm_start(image_state *s) {
+	int maxval = (1 << s->bits) - 1;
+	
+	static const char *tuple_type[5] = {
+		0, "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"
+	};
+	
+	switch (s->format) {
+		case IMAGE_PGM:
+			return fprintf(s->file, "P5\n%d %d\n%d\n",
+				s->width, s->height, maxval) > 0;
+		
+		case IMAGE_PPM:
+			return fprintf(s->file, "P6\n%d %d\n%d\n",
+				s->width, s->height, maxval) > 0;
+		
+		default:
+			return fprintf(s->file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\n"
+				"MAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+				s->width, s->height, s->channels, maxval,
+				tuple_type[s->channels]) > 0;
+	}
+}
+
+// ------------------------------------------------------
+// ImageWriter
+
+ImageWriter::ImageWriter() {
+	state = 0;
+}
+
+ImageWriter::~ImageWriter() {
+	close();
+}
+
+bool ImageWriter::open(const char *path, ImageFormat format,
+	int width, int height, int channels, int bits)
+{
+	close();
+	
+	if (width <= 0 || height <= 0) return false;
+	if (channels < 1 || channels > 4) return false;
+	if (bits != 8 && bits != 16) return false;
+	
+	if (format == IMAGE_PGM && channels != 1) return false;
+	if (format == IMAGE_PPM && channels != 3) return false;
+	
+	FILE *f = fopen(path, "wb");
+	if (f == 0) return false;
+	
+	image_state *s = new image_state;
+	
+	s->file     = f;
+	s->format   = format;
+	s->width    = width;
+	s->height   = height;
+	s->channels = channels;
+	s->bits     = bits;
+	
+	s->row_bytes = (size_t) width * channels * (bits / 8);
+	s->rows      = 0;
+	s->ok        = true;
+	
+	s->row    = new unsigned char[s->row_bytes];
+	s->rgb    = new unsigned char[3 * (size_t) width];
+	s->blocks = 0;
+	
+	state = s;
+	
+	if (format == IMAGE_PNG) s->ok = png_start(s);
+	else                     s->ok = netpbm_start(s);
+	
+	return s->ok;
+}
+
+bool ImageWriter::write_rows(const void *rows, int nrows, size_t stride) {
+	int r;
+	
+	if (state == 0 || !state->ok) return false;
+	
+	if (nrows < 0 || nrows > state->height - state->rows) {
+		state->ok = false;
+		return false;
+	}
+	
+	for (r=0; r<nrows; r++) {
+		const unsigned char *src = (const unsigned char*) rows + r*stride;
+		
+		if (state->format == IMAGE_PNG) {
+			png_add_row(state, src);
+			continue;
+		}
+		
+		convert_row(state, src, state->row);
+		
+		if (fwrite(state->row, 1, state->row_bytes, state->file)
+			!= state->row_bytes)
+		{
+			state->ok = false;
+		}
+	}
+	
+	state->rows += nrows;
+	
+	return state->ok;
+}
+
+bool ImageWriter::write_rgb(const uint32_t *pixels, int nrows) {
+	int r, x;
+	
+	if (state == 0 || state->channels != 3 || state->bits != 8)
+		return false;
+	
+	int width = state->width;
+	
+	for (r=0; r<nrows; r++) {
+		const uint32_t *src = pixels + (size_t) r * width;
+		unsigned char *dst = state->rgb;
+		
+		for (x=0; x<width; x++) {
+			dst[3*x]     = (unsigned char) (src[x] >> 16);
+			dst[3*x + 1] = (unsigned char) (src[x] >> 8);
+			dst[3*x + 2] = (unsigned char) src[x];
+		}
+		
+		if (!write_rows(dst, 1, 0)) return false;
+	}
+	
+	return true;
+}
+
+bool ImageWriter::close() {
+	int i;
+	
+	if (state == 0) return false;
+	
+	image_state *s = state;
+	state = 0;
+	
+	bool ok = s->ok && s->rows == s->height;
+	
+	if (s->format == IMAGE_PNG && s->blocks != 0) {
+		if (ok) ok = png_finish(s);
+		
+		for (i=0; i<s->nblocks; i++) {
+			delete[] s->blocks[i].raw;
+			delete[] s->blocks[i].prior;
+			delete[] s->blocks[i].filtered;
+			free(s->blocks[i].out.data);
+		}
+		
+		delete[] s->blocks;
+	}
+	
+	if (fclose(s->file) != 0) ok = false;
+	
+	delete[] s->row;
+	delete[] s->rgb;
+	delete s;
+	
+	return ok;
+}
+
+// ------------------------------------------------------
+// Saving views and patterns
+
+bool View::save_image(const char *path, ImageFormat format,
+	double near, double far) const
+{
+	const int band = 64;
+	int x, y, r;
+	
+	if (!(far != near)) return false;
+	
+	ImageWriter out;
+	
+	if (!out.open(path, format, width, height, 1, 16)) return false;
+	
+	uint16_t *rows = new uint16_t[band * width];
+	double scale = 1 / (far - near);
+	
+	bool ok = true;
+	
+	for (y=0; ok && y<height; y+=band) {
+		int n = height - y < band ? height - y : band;
+		
+		for (r=0; r<n; r++)
+		for (x=0; x<width; x++) {
+			double t = (far - get(x, y+r)) * scale;
+			
+			if (!(t > 0)) t = 0;
+			if (t > 1)    t = 1;
+			
+			rows[x + r*width] = (uint16_t) (t * 65535 + 0.5);
+		}
+		
+		ok = out.write_rows(rows, n, width * sizeof(uint16_t));
+	}
+	
+	delete[] rows;
+	
+	return out.close() && ok;
+}
+
+bool Pattern::save(const char *path, ImageFormat format) const {
+	ImageWriter out;
+	
+	if (!out.open(path, format, width, height, 3, 8)) return false;
+	
+	bool ok = out.write_rgb(pixels, height);
+	
+	return out.close() && ok;
+}
+
+// ------------------------------------------------------
+
+} /* namespace libeye */
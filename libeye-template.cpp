@@ -10,50 +10,70 @@ namespace libeye {
 // -------------------------------------------------------
 
 template<int N>
-point<N>::point() {
+LIBEYE_CONSTEXPR point<N>::point() : coords() {
 	// nada
 }
 
 template<int N>
-point<N>::point(double x, double y, double z) {
+LIBEYE_CONSTEXPR point<N>::point(double x, double y, double z) : coords() {
 	coords[0] = x;
 	coords[1] = y;
 	coords[2] = z;
 }
 
 template<int N>
-point<N>::point(double x, double y) {
+LIBEYE_CONSTEXPR point<N>::point(double x, double y) : coords() {
 	coords[0] = x;
 	coords[1] = y;
 }
 
 template<int N>
-double& point<N>::x() { return coords[0]; }
+template<class E>
+LIBEYE_CONSTEXPR point<N>::point(const vexpr<E, N> &e) : coords() {
+	for (int i=0; i<N; i++) {
+		coords[i] = e.self()[i];
+	}
+}
 
 template<int N>
-double& point<N>::y() { return coords[1]; }
+template<class E>
+LIBEYE_CONSTEXPR point<N>& point<N>::operator=(const vexpr<E, N> &e) {
+	// Expressions are element-wise, so reading and writing
+	// the same point in one loop is safe.
+	for (int i=0; i<N; i++) {
+		coords[i] = e.self()[i];
+	}
+	
+	return *this;
+}
 
 template<int N>
-double& point<N>::z() { return coords[2]; }
+LIBEYE_CONSTEXPR double& point<N>::x() { return coords[0]; }
 
 template<int N>
-double point<N>::x() const { return coords[0]; }
+LIBEYE_CONSTEXPR double& point<N>::y() { return coords[1]; }
 
 template<int N>
-double point<N>::y() const { return coords[1]; }
+LIBEYE_CONSTEXPR double& point<N>::z() { return coords[2]; }
 
 template<int N>
-double point<N>::z() const { return coords[2]; }
+LIBEYE_CONSTEXPR double point<N>::x() const { return coords[0]; }
 
-// -------------------------------------------------------
+template<int N>
+LIBEYE_CONSTEXPR double point<N>::y() const { return coords[1]; }
 
 template<int N>
-std::ostream& operator<<(std::ostream &s, const point<N> &p)
+LIBEYE_CONSTEXPR double point<N>::z() const { return coords[2]; }
+
+// -------------------------------------------------------
+
+template<class E, int N>
+std::ostream& operator<<(std::ostream &s, const vexpr<E, N> &p)
 {
 	s << "(";
 	
 	for (int i=0; i<N; i++) {
-		s << p[i];
+		s << p.self()[i];
 		
 		if (i < N-1) s << ", ";
 	}
@@ -63,88 +83,453 @@ std::ostream& operator<<(std::ostream &s, const point<N> &p)
 	return s;
 }
 
-template<int N>
-inline point<N> operator-(const point<N> &p)
+template<class A, int N>
+LIBEYE_CONSTEXPR vneg<A, N> operator-(const vexpr<A, N> &p)
+{
+	return vneg<A, N>(p.self());
+}
+
+template<class A, class B, int N>
+LIBEYE_CONSTEXPR vdiff<A, B, N> operator-(const vexpr<A, N> &p1,
+	const vexpr<B, N> &p2)
+{
+	return vdiff<A, B, N>(p1.self(), p2.self());
+}
+
+template<class A, class B, int N>
+LIBEYE_CONSTEXPR vsum<A, B, N> operator+(const vexpr<A, N> &p1,
+	const vexpr<B, N> &p2)
+{
+	return vsum<A, B, N>(p1.self(), p2.self());
+}
+
+template<class A, int N>
+LIBEYE_CONSTEXPR vscale<A, N> operator*(const vexpr<A, N> &p, double k)
 {
-	point<N> r;
+	return vscale<A, N>(p.self(), k);
+}
+
+template<class A, int N>
+LIBEYE_CONSTEXPR vscale<A, N> operator*(double k, const vexpr<A, N> &p)
+{
+	return vscale<A, N>(p.self(), k);
+}
+
+template<class A, int N>
+double norm(const vexpr<A, N> &p)
+{
+	double sum = 0;
 	int i;
 	
 	for (i=0; i<N; i++) {
-		r[i] = -p[i];
+		double c = p.self()[i];
+		sum += c * c;
 	}
 	
-	return r;
+	return sqrt(sum);
 }
 
-template<int N>
-inline point<N> operator-(const point<N> &p1, const point<N> &p2)
+template<class A, class B, int N>
+double dist(const vexpr<A, N> &p1, const vexpr<B, N> &p2)
+{
+	return norm(p1 - p2);
+}
+
+template<class A, class B, int N>
+LIBEYE_CONSTEXPR double dot(const vexpr<A, N> &p1, const vexpr<B, N> &p2)
 {
-	point<N> r;
+	double sum = 0;
 	
 	for (int i=0; i<N; i++) {
-		r[i] = p1[i] - p2[i];
+		sum += p1.self()[i] * p2.self()[i];
 	}
 	
-	return r;
+	return sum;
 }
 
-template<int N>
-inline point<N> operator+(const point<N> &p1, const point<N> &p2)
+LIBEYE_CONSTEXPR point3 cross(const point3 &p1, const point3 &p2)
 {
-	point<N> r;
+	return point3(
+		p1.y() * p2.z() - p1.z() * p2.y(),
+		p1.z() * p2.x() - p1.x() * p2.z(),
+		p1.x() * p2.y() - p1.y() * p2.x() );
+}
+
+// -------------------------------------------------------
+// GeneralGeometry
+
+inline GeneralGeometry::GeneralGeometry(const Screen &screen,
+		const point3 &_eye) :
+	projector(screen, _eye)
+{
+	eye  = _eye;
+	base = screen.origin - eye;
+	e1   = screen.e1;
+	e2   = screen.e2;
 	
-	for (int i=0; i<N; i++) {
-		r[i] = p1[i] + p2[i];
-	}
+	h = fabs(dot(cross(e1, e2), base)) / norm(cross(e1, e2));
 	
-	return r;
+	q0  = dot(base, base);
+	q1  = 2 * dot(base, e1);
+	q2  = 2 * dot(base, e2);
+	q11 = dot(e1, e1);
+	q12 = 2 * dot(e1, e2);
+	q22 = dot(e2, e2);
 }
 
-template<int N>
-inline point<N> operator*(const point<N> &p, double k)
+inline bool GeneralGeometry::project(const point3 &p,
+	double &x, double &y) const
+{
+	return projector.project(p, x, y);
+}
+
+inline void GeneralGeometry::plane(const point3 &normal,
+	double d, Plane &pl) const
 {
-	point<N> r;
+	pl.num = fabs(d - dot(normal, eye));
+	pl.a   = dot(normal, base);
+	pl.b   = dot(normal, e1);
+	pl.c   = dot(normal, e2);
+	pl.inv = 1 / (h * pl.num);
+}
+
+inline double GeneralGeometry::depth(const Plane &pl,
+	double x, double y) const
+{
+	double len2 = q0 + x*q1 + y*q2 + x*x*q11 + x*y*q12 + y*y*q22;
 	
-	for (int i=0; i<N; i++) {
-		r[i] = p[i] * k;
+	return pl.num * sqrt(len2) / fabs(pl.a + x*pl.b + y*pl.c);
+}
+
+inline double GeneralGeometry::inverse_z(const Plane &pl,
+	double x, double y) const
+{
+	return fabs(pl.a + x*pl.b + y*pl.c) * pl.inv;
+}
+
+inline point3 GeneralGeometry::at_depth(double x, double y,
+	double depth) const
+{
+	point3 leg = base + x*e1 + y*e2;
+	
+	return eye + leg * (depth / norm(leg));
+}
+
+// The ray to the screen is h long in z, so z = 1/u is
+// reached at 1/(u h) of it.
+inline point3 GeneralGeometry::at_inverse_z(double x, double y,
+	double u) const
+{
+	return eye + (base + x*e1 + y*e2) * (1 / (u * h));
+}
+
+// -------------------------------------------------------
+// AxisGeometry
+
+inline AxisGeometry::AxisGeometry(const Screen &screen,
+	const point3 &_eye)
+{
+	eye = _eye;
+	
+	ox = screen.origin.x();
+	oy = screen.origin.y();
+	oz = screen.origin.z();
+	
+	sx = screen.e1.x();
+	sy = screen.e2.y();
+	
+	ax = ox - eye.x();
+	ay = oy - eye.y();
+	az = oz - eye.z();
+	
+	h = fabs(az);
+}
+
+inline bool AxisGeometry::project(const point3 &p,
+	double &x, double &y) const
+{
+	double t = az / (p.z() - eye.z());
+	if (!(t > 0)) return false;
+	
+	x = (eye.x() + t*(p.x() - eye.x()) - ox) / sx;
+	y = (eye.y() + t*(p.y() - eye.y()) - oy) / sy;
+	
+	return true;
+}
+
+inline void AxisGeometry::plane(const point3 &normal,
+	double d, Plane &pl) const
+{
+	pl.num = fabs(d - dot(normal, eye));
+	pl.a   = normal.x()*ax + normal.y()*ay + normal.z()*az;
+	pl.b   = normal.x()*sx;
+	pl.c   = normal.y()*sy;
+	pl.inv = 1 / (h * pl.num);
+}
+
+inline double AxisGeometry::depth(const Plane &pl,
+	double x, double y) const
+{
+	double rx = ax + x*sx;
+	double ry = ay + y*sy;
+	
+	return pl.num * sqrt(rx*rx + ry*ry + az*az)
+		/ fabs(pl.a + x*pl.b + y*pl.c);
+}
+
+inline double AxisGeometry::inverse_z(const Plane &pl,
+	double x, double y) const
+{
+	return fabs(pl.a + x*pl.b + y*pl.c) * pl.inv;
+}
+
+inline point3 AxisGeometry::at_inverse_z(double x, double y,
+	double u) const
+{
+	double k = 1 / (u * h);
+	
+	return point3(eye.x() + k*(ax + x*sx),
+		eye.y() + k*(ay + y*sy), eye.z() + k*az);
+}
+
+inline point3 AxisGeometry::at_depth(double x, double y,
+	double depth) const
+{
+	double rx = ax + x*sx;
+	double ry = ay + y*sy;
+	
+	double k = depth / sqrt(rx*rx + ry*ry + az*az);
+	
+	return point3(eye.x() + k*rx, eye.y() + k*ry, eye.z() + k*az);
+}
+
+// -------------------------------------------------------
+// View
+
+inline void View::plot(int x, int y, double value) {
+	if (x < 0 || width  <= x) return;
+	if (y < 0 || height <= y) return;
+	
+	double &cur = buffer[x + y*width];
+	
+	if (depth_mode == DEPTH_INVERSE_Z) {
+		if (cur > value) return;
 	}
+	else {
+		if (cur < value) return;
+	}
+	
+	drawn.add(x, y);
+	
+	if (cur == value) return;
 	
-	return r;
+	cur = value;
+	dirty.add(x, y);
 }
 
-template<int N>
-inline point<N> operator*(double k, const point<N> &p)
+// -------------------------------------------------------
+// GeoView
+
+template<class Geometry>
+GeoView<Geometry>::GeoView(size_t _width, size_t _height) :
+	View(_width, _height)
 {
-	return p * k;
 }
 
-template<int N> double norm(const point<N> &p)
+template<class Geometry>
+GeoView<Geometry>::GeoView(size_t _width, size_t _height,
+		const Screen &_screen, const point3 &_eye) :
+	View(_width, _height, _screen, _eye)
 {
-	double sum = 0;
-	int i;
+}
+
+template<class Geometry>
+void GeoView<Geometry>::draw_point(const point3 &p) {
+	Geometry geom(screen, eye);
+	double x, y;
 	
-	for (i=0; i<N; i++) {
-		sum += p[i] * p[i];
+	if (!geom.project(p, x, y)) return;
+	
+	plot((int) x, (int) y, depth_value(p - eye, unit_normal()));
+}
+
+template<class Geometry>
+void GeoView<Geometry>::draw_triangle(const point3 &p1,
+	const point3 &p2, const point3 &p3)
+{
+	point3 p[3] = { p1, p2, p3 };
+	
+	draw_one(p, 0);
+}
+
+template<class Geometry>
+void GeoView<Geometry>::draw_triangles(const point3 *verts,
+	size_t ntris)
+{
+	size_t t;
+	SmallTriangle run;
+	
+	run.live = false;
+	
+	for (t=0; t<ntris; t++) {
+		draw_one(verts + 3*t, &run);
 	}
 	
-	return sqrt(sum);
+	end_small(run);
 }
 
-template<int N> double dist(const point<N> &p1, const point<N> &p2)
+template<class Geometry>
+void GeoView<Geometry>::draw_one(const point3 *p, SmallTriangle *run) {
+	Geometry geom(screen, eye);
+	point2 im[3];
+	
+	point3 normal = cross(p[1] - p[0], p[2] - p[0]);
+	if (dot(normal, normal) == 0) return;
+	
+	if (!geom.project(p[0], im[0].x(), im[0].y())) return;
+	if (!geom.project(p[1], im[1].x(), im[1].y())) return;
+	if (!geom.project(p[2], im[2].x(), im[2].y())) return;
+	
+	if (draw_small(p, im, run)) return;
+	
+	fill_triangle(im[0], im[1], im[2], normal, dot(normal, p[0]));
+}
+
+template<class Geometry>
+void GeoView<Geometry>::fill_triangle(const point2 &im1,
+	const point2 &im2, const point2 &im3,
+	const point3 &normal, double d)
 {
-	return norm(p1 - p2);
+	Geometry geom(screen, eye);
+	typename Geometry::Plane pl;
+	int x, y;
+	
+	geom.plane(normal, d, pl);
+	
+	minx = width;
+	maxx = 0;
+	
+	if ((int) im1.x() < minx) minx = (int) im1.x();
+	if ((int) im2.x() < minx) minx = (int) im2.x();
+	if ((int) im3.x() < minx) minx = (int) im3.x();
+	
+	if ((int) im1.x() > maxx) maxx = (int) im1.x();
+	if ((int) im2.x() > maxx) maxx = (int) im2.x();
+	if ((int) im3.x() > maxx) maxx = (int) im3.x();
+	
+	if (minx < 0)      minx = 0;
+	if (maxx >= width) maxx = width - 1;
+	
+	start_fill();
+	add_line(im1, im2);
+	add_line(im2, im3);
+	add_line(im3, im1);
+	
+	if (depth_mode == DEPTH_INVERSE_Z) {
+		for (x=minx; x<=maxx; x++)
+		for (y=miny[x]; y<=maxy[x]; y++) {
+			plot(x, y, geom.inverse_z(pl, x, y));
+		}
+	}
+	else {
+		for (x=minx; x<=maxx; x++)
+		for (y=miny[x]; y<=maxy[x]; y++) {
+			plot(x, y, geom.depth(pl, x, y));
+		}
+	}
 }
 
-template<int N> double dot(const point<N> &p1, const point<N> &p2)
+template<class Geometry>
+void GeoView<Geometry>::draw_pgram(const point3 &p,
+	const point3 e1, const point3 e2)
 {
-	double sum = 0;
-	int i;
+	draw_triangle(p, p+e1, p+e2);
+	draw_triangle(p+e1+e2, p+e1, p+e2);
+}
+
+template<class Geometry>
+point2 GeoView<Geometry>::stereo_pair(const point3 &eye2,
+	const point2 &p) const
+{
+	Geometry geom(screen, eye);
+	Geometry geom2(screen, eye2);
+	point2 pair;
 	
-	for (i=0; i<N; i++) {
-		sum += p1[i] * p2[i];
+	point3 far = geom.at_depth(p.x(), p.y(), get(p));
+	
+	if (!geom2.project(far, pair.x(), pair.y()))
+		return point2(-1, -1);
+	
+	return pair;
+}
+
+template<class Geometry>
+void GeoView<Geometry>::stereo_pairs(const point3 &eye2,
+	const Rect &area, int *out) const
+{
+	Geometry geom(screen, eye);
+	Geometry geom2(screen, eye2);
+	int x, y;
+	
+	Rect r = area.clip(width, height);
+	
+	for (y=r.y0; y<=r.y1; y++)
+	for (x=r.x0; x<=r.x1; x++) {
+		double pair_x, pair_y;
+		
+		double value = buffer[x + y*width];
+		
+		point3 far = depth_mode == DEPTH_INVERSE_Z ?
+			geom.at_inverse_z(x, y, value) :
+			geom.at_depth(x, y, value);
+		
+		if (!geom2.project(far, pair_x, pair_y))
+			pair_x = -1;
+		
+		out[x + y*width] = (int) pair_x;
 	}
+}
+
+// -------------------------------------------------------
+// StereoBlank
+
+template<class Geometry>
+void StereoBlank::set_left(const GeoView<Geometry> &left,
+	const point3 &eye, const Rect &r)
+{
+	expand();
+	left.stereo_pairs(eye, r, right_pair_buffer);
+}
+
+template<class Geometry>
+void StereoBlank::set_right(const GeoView<Geometry> &right,
+	const point3 &eye, const Rect &r)
+{
+	expand();
+	right.stereo_pairs(eye, r, left_pair_buffer);
+}
+
+// -------------------------------------------------------
+// Mesh
+
+template<class Target>
+void Mesh::draw(Target &target) const {
+	const size_t block = 1 << 12;
+	size_t t, i;
 	
-	return sum;
+	point3 *buf = new point3[3 * block];
+	
+	for (t=0; t<ntris; t+=block) {
+		size_t n = ntris - t < block ? ntris - t : block;
+		
+		for (i=0; i<n; i++) {
+			triangle(t + i, buf[3*i], buf[3*i+1], buf[3*i+2]);
+		}
+		
+		target.draw_triangles(buf, n);
+	}
+	
+	delete[] buf;
 }
 
 } /* namespace libeye */
@@ -2,38 +2,20 @@
 #include "libeye.hpp"
 
 #include "matrix.h"
+#include "parallel.hpp"
 #include <cmath>
+#include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <stdint.h>
 
 using namespace std;
 
 namespace libeye {
 
-// ------------------------------------------------------
-// Points
-
-point3 cross(const point3 &p1, const point3 &p2) {
-	return point3(
-		p1.y() * p2.z() - p1.z() * p2.y(),
-		p1.z() * p2.x() - p1.x() * p2.z(),
-		p1.x() * p2.y() - p1.y() * p2.x() );
-}
-
 // ------------------------------------------------------
 // Screen
 
-Screen::Screen() {
-	origin = point3(0, 0, 0);
-	e1     = point3(1, 0, 0);
-	e2     = point3(0, 1, 0);
-}
-
-Screen::Screen(const point3 &_origin, const point3 &_e1, const point3 &_e2) {
-	this->origin = _origin;
-	this->e1     = _e1;
-	this->e2     = _e2;
-}
-
 point3 Screen::to_real(const point2 &image) const {
 	return origin + image.x() * e1 + image.y() * e2;
 }
@@ -78,6 +60,108 @@ Screen Screen::line_normal(const point3 &p1,
 		cross((p2 - p1), normal) );
 }
 
+// -----------------------------------------------------------
+// Rect
+
+Rect::Rect() {
+	x0 = y0 = 0;
+	x1 = y1 = -1;
+}
+
+Rect::Rect(int _x0, int _y0, int _x1, int _y1) {
+	this->x0 = _x0;
+	this->y0 = _y0;
+	this->x1 = _x1;
+	this->y1 = _y1;
+}
+
+void Rect::add(int x, int y) {
+	if (empty()) {
+		x0 = x1 = x;
+		y0 = y1 = y;
+		return;
+	}
+	
+	if (x < x0) x0 = x;
+	if (x > x1) x1 = x;
+	if (y < y0) y0 = y;
+	if (y > y1) y1 = y;
+}
+
+void Rect::add(const Rect &r) {
+	if (r.empty()) return;
+	
+	add(r.x0, r.y0);
+	add(r.x1, r.y1);
+}
+
+Rect Rect::clip(int width, int height) const {
+	Rect r = *this;
+	
+	if (r.x0 < 0)       r.x0 = 0;
+	if (r.y0 < 0)       r.y0 = 0;
+	if (r.x1 >= width)  r.x1 = width - 1;
+	if (r.y1 >= height) r.y1 = height - 1;
+	
+	return r;
+}
+
+// -----------------------------------------------------------
+// Projector
+
+Projector::Projector(const Screen &screen, const point3 &_eye) {
+	this->eye = _eye;
+	
+	normal = cross(screen.e1, screen.e2);
+	
+	point3 a = cross(screen.e2, normal);
+	point3 b = cross(normal, screen.e1);
+	
+	u1 = a * (1 / dot(screen.e1, a));
+	u2 = b * (1 / dot(screen.e2, b));
+	
+	h  = dot(normal, screen.origin - eye);
+	c1 = dot(eye - screen.origin, u1);
+	c2 = dot(eye - screen.origin, u2);
+}
+
+bool Projector::project(const point3 &p, double &x, double &y) const {
+	point3 leg = p - eye;
+	
+	double s = h / dot(normal, leg);
+	if (!(s > 0)) return false;
+	
+	x = c1 + s * dot(leg, u1);
+	y = c2 + s * dot(leg, u2);
+	
+	return true;
+}
+
+void Projector::project(const point3 *p, size_t n,
+	double *x, double *y, double *depth, DepthMode mode) const
+{
+	size_t i;
+	
+	double scale = norm(normal);
+	bool inverse = mode == DEPTH_INVERSE_Z;
+	
+	for (i=0; i<n; i++) {
+		double lx = p[i].x() - eye.x();
+		double ly = p[i].y() - eye.y();
+		double lz = p[i].z() - eye.z();
+		
+		double w = lx*normal.x() + ly*normal.y() + lz*normal.z();
+		double s = h / w;
+		
+		s = s > 0 ? s : NAN;
+		
+		x[i] = c1 + s * (lx*u1.x() + ly*u1.y() + lz*u1.z());
+		y[i] = c2 + s * (lx*u2.x() + ly*u2.y() + lz*u2.z());
+		
+		depth[i] = inverse ? scale / fabs(w) : sqrt(lx*lx + ly*ly + lz*lz);
+	}
+}
+
 // -----------------------------------------------------------
 
 View::View(size_t _width, size_t _height) {
@@ -87,6 +171,9 @@ View::View(size_t _width, size_t _height) {
 	buffer = new double[width * height];
 	miny   = new int[width];
 	maxy   = new int[width];
+	
+	depth_mode = DEPTH_DISTANCE;
+	ray_h      = 0;
 }
 
 View::View(size_t _width, size_t _height,
@@ -100,6 +187,9 @@ View::View(size_t _width, size_t _height,
 	buffer = new double[width * height];
 	miny   = new int[width];
 	maxy   = new int[width];
+	
+	depth_mode = DEPTH_DISTANCE;
+	ray_h      = 0;
 }
 
 View::~View() {
@@ -112,6 +202,9 @@ double View::get(int x, int y) const {
 	if (x < 0 || width  <= x) return 0.0;
 	if (y < 0 || height <= y) return 0.0;
 	
+	if (depth_mode == DEPTH_INVERSE_Z)
+		return inverse_factor(x, y) / buffer[x + y*width];
+	
 	return buffer[x + y*width];
 }
 
@@ -120,12 +213,10 @@ double View::get(const point2 &p) const {
 }
 
 void View::draw(int x, int y, double depth) {
-	if (x < 0 || width  <= x) return;
-	if (y < 0 || height <= y) return;
+	if (depth_mode == DEPTH_INVERSE_Z)
+		depth = inverse_factor(x, y) / depth;
 	
-	if (buffer[x + y*width] < depth) return;
-	
-	buffer[x + y*width] = depth;
+	plot(x, y, depth);
 }
 
 void View::draw(const point2 &p, double depth) {
@@ -136,14 +227,41 @@ void View::set(int x, int y, double depth) {
 	if (x < 0 || width  <= x) return;
 	if (y < 0 || height <= y) return;
 	
-	buffer[x + y*width] = depth;
+	if (depth_mode == DEPTH_INVERSE_Z)
+		depth = inverse_factor(x, y) / depth;
+	
+	double &cur = buffer[x + y*width];
+	
+	drawn.add(x, y);
+	
+	if (cur == depth) return;
+	
+	cur = depth;
+	dirty.add(x, y);
 }
 
 void View::flatten(double offset) {
+	Rect all(0, 0, width-1, height-1);
+	
+	flatten(offset, all);
+	
+	// Every pixel may have moved, so update() must relink all
+	drawn      = all;
+	dirty      = all;
+	last_dirty = all;
+}
+
+void View::flatten(double offset, const Rect &area) {
+	flatten_area(offset, area);
+}
+
+Rect View::flatten_area(double offset, const Rect &area) {
 	int x, y;
 	
-	point3 normal = cross(screen.e1, screen.e2);
-	normal = normal * (1 / norm(normal));
+	Rect r = area.clip(width, height);
+	Rect moved;
+	
+	point3 normal = unit_normal();
 	
 	point2 im;
 	point3 real;
@@ -151,8 +269,8 @@ void View::flatten(double offset) {
 	double closest = dot(normal, screen.origin - eye);
 	closest = fabs(closest);
 	
-	for (x=0; x<width; x++)
-	for (y=0; y<height; y++) {
+	for (y=r.y0; y<=r.y1; y++)
+	for (x=r.x0; x<=r.x1; x++) {
 		im.x() = x;
 		im.y() = y;
 		
@@ -161,72 +279,590 @@ void View::flatten(double offset) {
 		double hypot = dist(real, eye);
 		double depth = hypot / closest * (closest + offset);
 		
-		buffer[x + y*width] = depth;
+		if (depth_mode == DEPTH_INVERSE_Z)
+			depth = 1 / (closest + offset);
+		
+		double &cur = buffer[x + y*width];
+		
+		if (cur == depth) continue;
+		
+		cur = depth;
+		moved.add(x, y);
+	}
+	
+	return moved;
+}
+
+void View::start_frame(double offset) {
+	// Drawn pixels already at the background depth do not
+	// count as changed
+	last_dirty = dirty;
+	last_dirty.add(flatten_area(offset, drawn));
+	
+	drawn = Rect();
+	dirty = Rect();
+}
+
+double View::ray_factor(double x, double y) const {
+	point3 ray = screen.to_real(point2(x, y)) - eye;
+	
+	return norm(ray) / fabs(dot(unit_normal(), ray));
+}
+
+void View::keep_rays() {
+	ray_base = screen.origin - eye;
+	ray_h    = fabs(dot(unit_normal(), ray_base));
+}
+
+// ray_factor through the kept constants; the screen's axes
+// lie in its plane, so only the ray's length varies
+double View::inverse_factor(int x, int y) const {
+	const point3 &e1 = screen.e1;
+	const point3 &e2 = screen.e2;
+	
+	double rx = ray_base.x() + x*e1.x() + y*e2.x();
+	double ry = ray_base.y() + x*e1.y() + y*e2.y();
+	double rz = ray_base.z() + x*e1.z() + y*e2.z();
+	
+	return sqrt(rx*rx + ry*ry + rz*rz) / ray_h;
+}
+
+struct resolve_job {
+	View *view;
+	
+	point3 base;
+	double h;
+};
+
+static void resolve_rows(void *arg, int begin, int end) {
+	resolve_job *job = (resolve_job*) arg;
+	int x, y;
+	
+	View *view = job->view;
+	const point3 &e1 = view->screen.e1;
+	const point3 &e2 = view->screen.e2;
+	
+	for (y=begin; y<end; y++) {
+		double *row = view->buffer + y * view->width;
+		
+		for (x=0; x<view->width; x++) {
+			double rx = job->base.x() + x*e1.x() + y*e2.x();
+			double ry = job->base.y() + x*e1.y() + y*e2.y();
+			double rz = job->base.z() + x*e1.z() + y*e2.z();
+			
+			double factor = sqrt(rx*rx + ry*ry + rz*rz) / job->h;
+			
+			// distance = factor / (1/z), and back
+			row[x] = factor / row[x];
+		}
 	}
 }
 
+void View::set_depth_mode(DepthMode mode) {
+	resolve_job job;
+	
+	if (mode == depth_mode) return;
+	
+	keep_rays();
+	
+	job.view = this;
+	job.base = ray_base;
+	job.h    = ray_h;
+	
+	parallel_for(height, resolve_rows, &job);
+	
+	depth_mode = mode;
+}
+
+void View::resolve() {
+	set_depth_mode(DEPTH_DISTANCE);
+}
+
+double View::depth_value(const point3 &leg, const point3 &normal) const {
+	if (depth_mode == DEPTH_INVERSE_Z)
+		return 1 / fabs(dot(normal, leg));
+	
+	return norm(leg);
+}
+
+Rect View::changed() const {
+	Rect r = dirty;
+	r.add(last_dirty);
+	
+	return r;
+}
+
 void View::draw_point(const point3 &p) {
 	point2 image = screen.project(eye, p);
 	
 	int x = (int) image.x();
 	int y = (int) image.y();
 	
-	draw(x, y, dist(p, eye));
+	plot(x, y, depth_value(p - eye, unit_normal()));
 }
 
-void View::draw_line(const point3 &p1, const point3 &p2) {
-	int i;
-	point2 scan;
+// Point splatting runs over blocks of points in three parallel
+// passes: project and count how many points land in each band of
+// rows, scatter point indices into per-band lists, then splat each
+// band from its own thread. Bands are disjoint so the depth test
+// needs no locking.
+
+struct splat_job {
+	View *view;
+	Projector *proj;
 	
-	Screen remote = Screen::line_normal(p1, p2, p1 - eye);
+	const point3 *pts;
+	int n;
 	
-	point2 im1 = screen.project(eye, p1);
-	point2 im2 = screen.project(eye, p2);
+	double radius;
 	
-	int len = (int) dist(im1, im2);
+	int nchunks;
+	int nbands;
+	int band_height;
 	
-	for (i=0; i<=len; i++) {
-		double t = (double) i / len;
+	double *x;
+	double *y;
+	double *depth;
+	
+	Rect *band_drawn; // [band]
+	Rect *band_dirty; // [band]
+	
+	int *counts;      // [chunk * nbands + band]
+	int *band_start;  // [band], nbands+1 entries
+	int *list;
+};
+
+static inline int splat_chunk_begin(const splat_job *job, int c) {
+	return (int) ((long long) job->n * c / job->nchunks);
+}
+
+// Rows covered by the disc around point i, or false if it
+// misses the view entirely.
+static inline bool splat_rows(const splat_job *job, int i,
+	int &ylo, int &yhi)
+{
+	double x = job->x[i];
+	double y = job->y[i];
+	double r = job->radius;
+	
+	const View *view = job->view;
+	
+	if (!(x + r >= 0 && x - r < view->width))  return false;
+	if (!(y + r >= 0 && y - r < view->height)) return false;
+	
+	int cy = (int) floor(y);
+	
+	ylo = (int) ceil(y - r - 0.5);
+	yhi = (int) floor(y + r - 0.5);
+	
+	if (ylo > cy) ylo = cy;
+	if (yhi < cy) yhi = cy;
+	
+	if (ylo < 0)             ylo = 0;
+	if (yhi >= view->height) yhi = view->height - 1;
+	
+	return ylo <= yhi;
+}
+
+static void splat_project(void *arg, int begin, int end) {
+	splat_job *job = (splat_job*) arg;
+	int c, i, b;
+	
+	for (c=begin; c<end; c++) {
+		int first = splat_chunk_begin(job, c);
+		int last  = splat_chunk_begin(job, c+1);
+		
+		int *counts = job->counts + c * job->nbands;
+		
+		job->proj->project(job->pts + first, last - first,
+			job->x + first, job->y + first, job->depth + first,
+			job->view->depth_mode);
+		
+		for (b=0; b<job->nbands; b++) counts[b] = 0;
+		
+		for (i=first; i<last; i++) {
+			int ylo, yhi;
+			if (!splat_rows(job, i, ylo, yhi)) continue;
+			
+			for (b=ylo/job->band_height; b<=yhi/job->band_height; b++)
+				counts[b]++;
+		}
+	}
+}
+
+static void splat_scatter(void *arg, int begin, int end) {
+	splat_job *job = (splat_job*) arg;
+	int c, i, b;
+	
+	for (c=begin; c<end; c++) {
+		int first = splat_chunk_begin(job, c);
+		int last  = splat_chunk_begin(job, c+1);
+		
+		// After the prefix sum, counts holds this chunk's
+		// write position in each band's list.
+		int *pos = job->counts + c * job->nbands;
+		
+		for (i=first; i<last; i++) {
+			int ylo, yhi;
+			if (!splat_rows(job, i, ylo, yhi)) continue;
+			
+			for (b=ylo/job->band_height; b<=yhi/job->band_height; b++)
+				job->list[pos[b]++] = i;
+		}
+	}
+}
+
+static void splat_bands(void *arg, int begin, int end) {
+	splat_job *job = (splat_job*) arg;
+	int b, k, x, y;
+	
+	View *view = job->view;
+	double r  = job->radius;
+	double r2 = r * r;
+	
+	// Compare distances as they are and 1/z negated
+	double sign = view->depth_mode == DEPTH_INVERSE_Z ? -1 : 1;
+	
+	for (b=begin; b<end; b++) {
+		int row0 = b * job->band_height;
+		int row1 = row0 + job->band_height - 1;
+		
+		for (k=job->band_start[b]; k<job->band_start[b+1]; k++) {
+			int i = job->list[k];
+			
+			int ylo = 0, yhi = -1;
+			splat_rows(job, i, ylo, yhi);
+			
+			if (ylo < row0) ylo = row0;
+			if (yhi > row1) yhi = row1;
+			
+			double px    = job->x[i];
+			double py    = job->y[i];
+			double depth = job->depth[i];
+			
+			int cx = (int) floor(px);
+			int cy = (int) floor(py);
+			
+			for (y=ylo; y<=yhi; y++) {
+				double dy = y + 0.5 - py;
+				double half = r2 > dy*dy ? sqrt(r2 - dy*dy) : 0;
+				
+				int xlo = (int) ceil(px - half - 0.5);
+				int xhi = (int) floor(px + half - 0.5);
+				
+				if (y == cy) {
+					if (xlo > cx) xlo = cx;
+					if (xhi < cx) xhi = cx;
+				}
+				
+				if (xlo < 0)            xlo = 0;
+				if (xhi >= view->width) xhi = view->width - 1;
+				
+				double *row = view->buffer + y * view->width;
+				
+				for (x=xlo; x<=xhi; x++) {
+					if (sign*row[x] < sign*depth) continue;
+					
+					job->band_drawn[b].add(x, y);
+					
+					if (row[x] == depth) continue;
+					
+					row[x] = depth;
+					job->band_dirty[b].add(x, y);
+				}
+			}
+		}
+	}
+}
+
+void View::draw_points(const point3 *pts, size_t n, float radius) {
+	int c, b;
+	
+	const int block = 1 << 20;
+	
+	if (n == 0 || width <= 0 || height <= 0) return;
+	
+	Projector proj(screen, eye);
+	splat_job job;
+	
+	job.view   = this;
+	job.proj   = &proj;
+	job.radius = radius > 0 ? radius : 0;
+	
+	job.nchunks     = worker_count();
+	job.nbands      = 4 * job.nchunks;
+	if (job.nbands > height) job.nbands = height;
+	job.band_height = (height + job.nbands - 1) / job.nbands;
+	job.nbands      = (height + job.band_height - 1) / job.band_height;
+	
+	job.x          = new double[block];
+	job.y          = new double[block];
+	job.depth      = new double[block];
+	job.counts     = new int[job.nchunks * job.nbands];
+	job.band_start = new int[job.nbands + 1];
+	job.band_drawn = new Rect[job.nbands];
+	job.band_dirty = new Rect[job.nbands];
+	job.list       = 0;
+	
+	int list_size = 0;
+	
+	while (n > 0) {
+		job.pts = pts;
+		job.n   = n < (size_t) block ? (int) n : block;
+		
+		parallel_for(job.nchunks, splat_project, &job);
+		
+		// Prefix sum, ordered by band then by chunk so that
+		// points keep their input order within a band.
+		int total = 0;
+		
+		for (b=0; b<job.nbands; b++) {
+			job.band_start[b] = total;
+			
+			for (c=0; c<job.nchunks; c++) {
+				int count = job.counts[c*job.nbands + b];
+				job.counts[c*job.nbands + b] = total;
+				total += count;
+			}
+		}
+		job.band_start[job.nbands] = total;
+		
+		if (total > list_size) {
+			delete[] job.list;
+			list_size = total;
+			job.list  = new int[list_size];
+		}
 		
-		scan = t*im1 + (1-t)*im2;
+		parallel_for(job.nchunks, splat_scatter, &job);
+		parallel_for(job.nbands, splat_bands, &job);
+		
+		pts += job.n;
+		n   -= job.n;
+	}
+	
+	for (b=0; b<job.nbands; b++) {
+		drawn.add(job.band_drawn[b]);
+		dirty.add(job.band_dirty[b]);
+	}
+	
+	delete[] job.x;
+	delete[] job.y;
+	delete[] job.depth;
+	delete[] job.counts;
+	delete[] job.band_start;
+	delete[] job.band_drawn;
+	delete[] job.band_dirty;
+	delete[] job.list;
+}
+
+void View::draw_line(const point3 &p1, const point3 &p2) {
+	point3 normal = unit_normal();
+	LineVertex v1, v2;
+	
+	line_vertex(v1, p1, normal);
+	line_vertex(v2, p2, normal);
+	
+	scan_line(v1, v2);
+}
+
+void View::draw_polyline(const point3 *p, size_t n) {
+	size_t i;
+	
+	if (n < 2) {
+		if (n == 1) draw_point(p[0]);
+		return;
+	}
+	
+	point3 normal = unit_normal();
+	LineVertex v[2];
+	
+	line_vertex(v[0], p[0], normal);
+	
+	for (i=1; i<n; i++) {
+		line_vertex(v[i%2], p[i], normal);
+		scan_line(v[(i-1)%2], v[i%2]);
+	}
+}
+
+void View::draw_lines(const point3 *verts, size_t nverts,
+	const int *index, size_t nlines)
+{
+	size_t i;
+	
+	point3 normal = unit_normal();
+	LineVertex *v = new LineVertex[nverts];
+	
+	for (i=0; i<nverts; i++) {
+		line_vertex(v[i], verts[i], normal);
+	}
+	
+	for (i=0; i<nlines; i++) {
+		size_t a = (size_t) index[2*i];
+		size_t b = (size_t) index[2*i+1];
 		
-		double depth = dist(eye,
-			screen.project_back(remote, eye, scan));
+		// Negative indices wrap past nverts too
+		if (a >= nverts || b >= nverts) continue;
 		
-		draw((int) scan.x(), (int) scan.y(), depth);
+		scan_line(v[a], v[b]);
 	}
+	
+	delete[] v;
 }
 
 void View::draw_triangle(const point3 &p1,
 	const point3 &p2, const point3 &p3)
 {
-	Screen remote = Screen::three_points(p1, p2, p3);
+	point3 p[3] = { p1, p2, p3 };
 	
-	point2 im1 = screen.project(eye, p1);
-	point2 im2 = screen.project(eye, p2);
-	point2 im3 = screen.project(eye, p3);
+	draw_one(p, 0);
+}
+
+void View::draw_triangles(const point3 *verts, size_t ntris) {
+	size_t t;
+	SmallTriangle run;
+	
+	run.live = false;
+	
+	for (t=0; t<ntris; t++) {
+		draw_one(verts + 3*t, &run);
+	}
+	
+	end_small(run);
+}
+
+void View::draw_one(const point3 *p, SmallTriangle *run) {
+	point3 normal = cross(p[1] - p[0], p[2] - p[0]);
+	if (dot(normal, normal) == 0) return;
+	
+	point2 im[3];
+	
+	im[0] = screen.project(eye, p[0]);
+	im[1] = screen.project(eye, p[1]);
+	im[2] = screen.project(eye, p[2]);
+	
+	if (draw_small(p, im, run)) return;
+	
+	Screen remote = Screen::three_points(p[0], p[1], p[2]);
 	
 	minx = width;
 	maxx = 0;
 	
-	if ((int) im1.x() < minx) minx = (int) im1.x();
-	if ((int) im2.x() < minx) minx = (int) im2.x();
-	if ((int) im3.x() < minx) minx = (int) im3.x();
+	if ((int) im[0].x() < minx) minx = (int) im[0].x();
+	if ((int) im[1].x() < minx) minx = (int) im[1].x();
+	if ((int) im[2].x() < minx) minx = (int) im[2].x();
 	
-	if ((int) im1.x() > maxx) maxx = (int) im1.x();
-	if ((int) im2.x() > maxx) maxx = (int) im2.x();
-	if ((int) im3.x() > maxx) maxx = (int) im3.x();
+	if ((int) im[0].x() > maxx) maxx = (int) im[0].x();
+	if ((int) im[1].x() > maxx) maxx = (int) im[1].x();
+	if ((int) im[2].x() > maxx) maxx = (int) im[2].x();
 	
 	if (minx < 0)      minx = 0;
 	if (maxx >= width) maxx = width - 1;
 	
 	start_fill();
-	add_line(im1, im2);
-	add_line(im2, im3);
-	add_line(im3, im1);
+	add_line(im[0], im[1]);
+	add_line(im[1], im[2]);
+	add_line(im[2], im[0]);
 	end_fill(remote);
 }
 
+// Sub-pixel triangles would mostly miss every pixel centre in
+// the fill, and add_line skips edges less than a pixel wide, so
+// thin triangles can vanish; both are drawn directly instead.
+bool View::draw_small(const point3 *p, const point2 *im,
+	SmallTriangle *run)
+{
+	int i;
+	
+	double x0 = im[0].x(), x1 = x0;
+	double y0 = im[0].y(), y1 = y0;
+	
+	for (i=1; i<3; i++) {
+		if (im[i].x() < x0) x0 = im[i].x();
+		if (im[i].x() > x1) x1 = im[i].x();
+		if (im[i].y() < y0) y0 = im[i].y();
+		if (im[i].y() > y1) y1 = im[i].y();
+	}
+	
+	// Not finite
+	if (!(x1 - x0 < HUGE_VAL) || !(y1 - y0 < HUGE_VAL)) return true;
+	
+	// Off screen
+	if (x1 <= -1 || x0 >= width)  return true;
+	if (y1 <= -1 || y0 >= height) return true;
+	
+	if (x1 - x0 < 1 && y1 - y0 < 1) {
+		point2 c = (im[0] + im[1] + im[2]) * (1.0/3);
+		point3 leg = (p[0] + p[1] + p[2]) * (1.0/3) - eye;
+		
+		int x = (int) c.x();
+		int y = (int) c.y();
+		
+		if (run == 0) {
+			plot(x, y, depth_value(leg, unit_normal()));
+			return true;
+		}
+		
+		double w = dot(leg, leg);
+		
+		if (run->live && run->x == x && run->y == y) {
+			if (w < run->w) {
+				run->leg = leg;
+				run->w   = w;
+			}
+			return true;
+		}
+		
+		end_small(*run);
+		
+		run->x    = x;
+		run->y    = y;
+		run->leg  = leg;
+		run->w    = w;
+		run->live = true;
+		
+		return true;
+	}
+	
+	// Longest edge, and whether the triangle is under half a
+	// pixel across it. Filling also needs it a pixel wide, as
+	// add_line drops edges narrower than that.
+	int e = 0;
+	double len = 0;
+	
+	for (i=0; i<3; i++) {
+		point2 edge = im[(i+1)%3] - im[i];
+		double l = dot(edge, edge);
+		
+		if (l > len) {
+			len = l;
+			e   = i;
+		}
+	}
+	
+	point2 e1 = im[1] - im[0];
+	point2 e2 = im[2] - im[0];
+	double area = e1.x()*e2.y() - e1.y()*e2.x();
+	
+	if (area*area >= 0.25*len && x1 - x0 >= 1) return false;
+	
+	LineVertex v1, v2;
+	point3 normal = unit_normal();
+	
+	line_vertex(v1, p[e], normal);
+	line_vertex(v2, p[(e+1)%3], normal);
+	
+	scan_line(v1, v2);
+	
+	return true;
+}
+
+void View::end_small(SmallTriangle &run) {
+	if (!run.live) return;
+	
+	plot(run.x, run.y, depth_value(run.leg, unit_normal()));
+	run.live = false;
+}
+
 void View::draw_pgram(const point3 &p,
 	const point3 e1, const point3 e2)
 {
@@ -244,6 +880,58 @@ point2 View::stereo_pair(const point3 &eye2, const point2 &p) const {
 	return screen.project(eye2, far);
 }
 
+point3 View::unit_normal() const {
+	point3 normal = cross(screen.e1, screen.e2);
+	
+	return normal * (1 / norm(normal));
+}
+
+void View::line_vertex(LineVertex &v, const point3 &p,
+	const point3 &normal) const
+{
+	point3 leg = p - eye;
+	
+	v.im = screen.project(eye, p);
+	v.r  = 1 / dot(normal, leg);
+	v.q  = leg * v.r;
+}
+
+// Incremental (DDA) version of stepping the segment and calling
+// project_back at every sample: q and r are stepped linearly
+// along the image and the 3D point is recovered as q / r.
+void View::scan_line(const LineVertex &v1, const LineVertex &v2) {
+	int i;
+	
+	int len = (int) dist(v1.im, v2.im);
+	
+	if (len == 0) {
+		plot((int) v1.im.x(), (int) v1.im.y(),
+			depth_mode == DEPTH_INVERSE_Z ?
+				fabs(v1.r) : norm(v1.q * (1 / v1.r)));
+		return;
+	}
+	
+	double k = 1.0 / len;
+	
+	point2 scan  = v2.im;
+	point2 dscan = (v1.im - v2.im) * k;
+	
+	point3 q  = v2.q;
+	point3 dq = (v1.q - v2.q) * k;
+	
+	double r  = v2.r;
+	double dr = (v1.r - v2.r) * k;
+	
+	for (i=0; i<=len; i++) {
+		plot((int) scan.x(), (int) scan.y(),
+			depth_mode == DEPTH_INVERSE_Z ? fabs(r) : norm(q) / fabs(r));
+		
+		scan = scan + dscan;
+		q    = q + dq;
+		r    = r + dr;
+	}
+}
+
 void View::start_fill() {
 	int x;
 	
@@ -293,15 +981,15 @@ void View::add_line(const point2 &im1, const point2 &im2) {
 void View::end_fill(const Screen &remote) {
 	int x, y;
 	
+	point3 normal = unit_normal();
+	
 	for (x=minx; x<=maxx; x++)
 	for (y=miny[x]; y<=maxy[x]; y++) {
 		
 		point3 back = screen.project_back(
 			remote, eye, point2(x,y));
 		
-		double depth = dist(eye, back);
-		
-		draw(x, y, depth);
+		plot(x, y, depth_value(back - eye, normal));
 	}
 }
 
@@ -357,6 +1045,21 @@ void BiView::flatten(double depth) {
 	right.flatten(depth);
 }
 
+void BiView::start_frame(double depth) {
+	left.start_frame(depth);
+	right.start_frame(depth);
+}
+
+void BiView::set_depth_mode(DepthMode mode) {
+	left.set_depth_mode(mode);
+	right.set_depth_mode(mode);
+}
+
+void BiView::resolve() {
+	left.resolve();
+	right.resolve();
+}
+
 void BiView::draw_point(const point3 &p) {
 	left.draw_point(p);
 	right.draw_point(p);
@@ -367,6 +1070,23 @@ void BiView::draw_line(const point3 &p1, const point3 &p2) {
 	right.draw_line(p1, p2);
 }
 
+void BiView::draw_points(const point3 *pts, size_t n, float radius) {
+	left.draw_points(pts, n, radius);
+	right.draw_points(pts, n, radius);
+}
+
+void BiView::draw_polyline(const point3 *p, size_t n) {
+	left.draw_polyline(p, n);
+	right.draw_polyline(p, n);
+}
+
+void BiView::draw_lines(const point3 *verts, size_t nverts,
+	const int *index, size_t nlines)
+{
+	left.draw_lines(verts, nverts, index, nlines);
+	right.draw_lines(verts, nverts, index, nlines);
+}
+
 void BiView::draw_triangle(const point3 &p1,
 	const point3 &p2, const point3 &p3)
 {
@@ -374,6 +1094,11 @@ void BiView::draw_triangle(const point3 &p1,
 	right.draw_triangle(p1, p2, p3);
 }
 
+void BiView::draw_triangles(const point3 *verts, size_t ntris) {
+	left.draw_triangles(verts, ntris);
+	right.draw_triangles(verts, ntris);
+}
+
 void BiView::draw_pgram(const point3 &p,
 	const point3 e1, const point3 e2)
 {
@@ -395,41 +1120,76 @@ StereoBlank::StereoBlank(int _width, int _height) {
 	this->width  = _width;
 	this->height = _height;
 	
-	left_pair_buffer  = new int[width * height];
-	right_pair_buffer = new int[width * height];
+	allocate();
 }
 
 StereoBlank::StereoBlank(const BiView &biview) {
 	this->width  = biview.right.width;
 	this->height = biview.right.height;
 	
-	left_pair_buffer  = new int[width * height];
-	right_pair_buffer = new int[width * height];
+	allocate();
+	
+	Rect all(0, 0, width-1, height-1);
 	
-	set_left(biview.left, biview.right.eye);
-	set_right(biview.right, biview.left.eye);
+	set_left(biview.left, biview.right.eye, all);
+	set_right(biview.right, biview.left.eye, all);
 }
 
 StereoBlank::StereoBlank(const View &right, const point3 &eye) {
 	this->width  = right.width;
 	this->height = right.height;
 	
-	left_pair_buffer  = new int[width * height];
-	right_pair_buffer = new int[width * height];
+	allocate();
 	
 	set_right(right, eye);
 }
 
+// Compact pair arrays, as made by encode_pairs
+static void delete_offsets(void *offsets, PairEncoding encoding) {
+	if (encoding == PAIRS_OFFSET16) delete[] (int16_t*) offsets;
+	else                            delete[] (int8_t*) offsets;
+}
+
 StereoBlank::~StereoBlank() {
 	delete[] left_pair_buffer;
 	delete[] right_pair_buffer;
+	
+	delete_offsets(left_offsets, encoding);
+	delete_offsets(right_offsets, encoding);
+	
+	delete grid_pool;
+}
+
+void StereoBlank::allocate() {
+	left_pair_buffer  = new int[width * height];
+	right_pair_buffer = new int[width * height];
+	
+	encoding      = PAIRS_ABSOLUTE;
+	left_offsets  = 0;
+	right_offsets = 0;
+	
+	grid_pool = new WorkerPool;
 }
 
 void StereoBlank::set_left(const View &left, const point3 &eye) {
+	set_left(left, eye, Rect(0, 0, width-1, height-1));
+}
+
+void StereoBlank::set_right(const View &right, const point3 &eye) {
+	set_right(right, eye, Rect(0, 0, width-1, height-1));
+}
+
+void StereoBlank::set_left(const View &left, const point3 &eye,
+	const Rect &area)
+{
 	int x, y;
 	
-	for (x=0; x<width; x++)
-	for (y=0; y<height; y++) {
+	expand();
+	
+	Rect r = area.clip(width, height);
+	
+	for (y=r.y0; y<=r.y1; y++)
+	for (x=r.x0; x<=r.x1; x++) {
 		
 		point2 p(x, y);
 		p = left.stereo_pair(eye, p);
@@ -440,11 +1200,17 @@ void StereoBlank::set_left(const View &left, const point3 &eye) {
 	}
 }
 
-void StereoBlank::set_right(const View &right, const point3 &eye) {
+void StereoBlank::set_right(const View &right, const point3 &eye,
+	const Rect &area)
+{
 	int x, y;
 	
-	for (x=0; x<width; x++)
-	for (y=0; y<height; y++) {
+	expand();
+	
+	Rect r = area.clip(width, height);
+	
+	for (y=r.y0; y<=r.y1; y++)
+	for (x=r.x0; x<=r.x1; x++) {
 		
 		point2 p(x, y);
 		p = right.stereo_pair(eye, p);
@@ -455,16 +1221,23 @@ void StereoBlank::set_right(const View &right, const point3 &eye) {
 	}
 }
 
+// A pair only depends on the depth at its own pixel, so each
+// buffer only needs relinking where its view changed.
+void StereoBlank::update(const BiView &biview) {
+	set_left(biview.left, biview.right.eye, biview.left.changed());
+	set_right(biview.right, biview.left.eye, biview.right.changed());
+}
+
 int StereoBlank::get_left(int x, int y) const {
 	if (x < 0 || x >= width)  return -1;
 	if (y < 0 || y >= height) return -1;
 	
-	int pair_x = left_pair_buffer[x + y*width];
+	int pair_x = left_at(x, y);
 	
 	if (pair_x < 0 || pair_x >= width)
 		return -1;
 	
-	int check_x = right_pair_buffer[pair_x + y*width];
+	int check_x = right_at(pair_x, y);
 	
 	if (std::abs((double)(check_x - x)) > 2)
 		return -1;
@@ -476,12 +1249,12 @@ int StereoBlank::get_right(int x, int y) const {
 	if (x < 0 || x >= width)  return -1;
 	if (y < 0 || y >= height) return -1;
 	
-	int pair_x = right_pair_buffer[x + y*width];
+	int pair_x = right_at(x, y);
 	
 	if (pair_x < 0 || pair_x >= width)
 		return -1;
 	
-	int check_x = left_pair_buffer[pair_x + y*width];
+	int check_x = left_at(pair_x, y);
 	
 	if (std::abs((double)(check_x - x)) > 2)
 		return -1;
@@ -493,7 +1266,7 @@ int StereoBlank::force_left(int x, int y) const {
 	if (x < 0 || x >= width)  return -1;
 	if (y < 0 || y >= height) return -1;
 	
-	int pair_x = left_pair_buffer[x + y*width];
+	int pair_x = left_at(x, y);
 	
 	if (pair_x < 0 || pair_x >= width)
 		return -1;
@@ -505,7 +1278,7 @@ int StereoBlank::force_right(int x, int y) const {
 	if (x < 0 || x >= width)  return -1;
 	if (y < 0 || y >= height) return -1;
 	
-	int pair_x = right_pair_buffer[x + y*width];
+	int pair_x = right_at(x, y);
 	
 	if (pair_x < 0 || pair_x >= width)
 		return -1;
@@ -513,43 +1286,235 @@ int StereoBlank::force_right(int x, int y) const {
 	return pair_x;
 }
 
+// ----------------
+// Pair encodings
+
+// Decoded value of a compact entry that holds no pixel of
+// the row; far enough from every x to fail any check.
+static const int no_pair = -(1 << 30);
+
+template<class T>
+static inline int decode_pair(const void *offsets, int x, int i) {
+	T offset = ((const T*) offsets)[i];
+	
+	if (offset == std::numeric_limits<T>::min())
+		return no_pair;
+	
+	return x + offset;
+}
+
+int StereoBlank::left_at(int x, int y) const {
+	switch (encoding) {
+		case PAIRS_OFFSET16:
+			return decode_pair<int16_t>(left_offsets, x, x + y*width);
+		case PAIRS_OFFSET8:
+			return decode_pair<int8_t>(left_offsets, x, x + y*width);
+		default:
+			return left_pair_buffer[x + y*width];
+	}
+}
+
+int StereoBlank::right_at(int x, int y) const {
+	switch (encoding) {
+		case PAIRS_OFFSET16:
+			return decode_pair<int16_t>(right_offsets, x, x + y*width);
+		case PAIRS_OFFSET8:
+			return decode_pair<int8_t>(right_offsets, x, x + y*width);
+		default:
+			return right_pair_buffer[x + y*width];
+	}
+}
+
+// get_left and get_right accept a cross-check within 2 of x,
+// so pairs up to 2 pixels outside the row still matter
+static const int pair_margin = 2;
+
+// Largest |pair_x - x| over pairs in the row or its margin.
+// Pairs further out only need the sentinel.
+static int max_offset(const int *pairs, int width, int height) {
+	int x, y;
+	int most = 0;
+	
+	for (y=0; y<height; y++)
+	for (x=0; x<width; x++) {
+		int pair_x = pairs[x + y*width];
+		
+		if (pair_x < -pair_margin || pair_x >= width + pair_margin)
+			continue;
+		
+		int offset = std::abs(pair_x - x);
+		if (offset > most) most = offset;
+	}
+	
+	return most;
+}
+
+// Offsets in [-max, max] are kept as they are, even for pairs
+// outside the row; the type's minimum is only ever the
+// sentinel. With max_offset under max, every pair that an
+// accessor can tell apart from no pair decodes exactly.
+template<class T>
+static void *encode_pairs(const int *pairs, int width, int height) {
+	int x, y;
+	
+	T *offsets = new T[width * height];
+	
+	const int hi = std::numeric_limits<T>::max();
+	const int lo = -hi;
+	
+	for (y=0; y<height; y++)
+	for (x=0; x<width; x++) {
+		long offset = (long) pairs[x + y*width] - x;
+		
+		offsets[x + y*width] = (offset < lo || offset > hi) ?
+			std::numeric_limits<T>::min() : (T) offset;
+	}
+	
+	return offsets;
+}
+
+bool StereoBlank::compact() {
+	if (encoding != PAIRS_ABSOLUTE) return true;
+	
+	int most = max_offset(left_pair_buffer, width, height);
+	int m2   = max_offset(right_pair_buffer, width, height);
+	if (m2 > most) most = m2;
+	
+	if (most <= std::numeric_limits<int8_t>::max()) {
+		left_offsets  = encode_pairs<int8_t>(left_pair_buffer, width, height);
+		right_offsets = encode_pairs<int8_t>(right_pair_buffer, width, height);
+		encoding = PAIRS_OFFSET8;
+	}
+	else if (most <= std::numeric_limits<int16_t>::max()) {
+		left_offsets  = encode_pairs<int16_t>(left_pair_buffer, width, height);
+		right_offsets = encode_pairs<int16_t>(right_pair_buffer, width, height);
+		encoding = PAIRS_OFFSET16;
+	}
+	else {
+		return false;
+	}
+	
+	delete[] left_pair_buffer;
+	delete[] right_pair_buffer;
+	
+	left_pair_buffer  = 0;
+	right_pair_buffer = 0;
+	
+	return true;
+}
+
+void StereoBlank::expand() {
+	int x, y;
+	
+	if (encoding == PAIRS_ABSOLUTE) return;
+	
+	left_pair_buffer  = new int[width * height];
+	right_pair_buffer = new int[width * height];
+	
+	for (y=0; y<height; y++)
+	for (x=0; x<width; x++) {
+		left_pair_buffer[x + y*width]  = left_at(x, y);
+		right_pair_buffer[x + y*width] = right_at(x, y);
+	}
+	
+	delete_offsets(left_offsets, encoding);
+	delete_offsets(right_offsets, encoding);
+	
+	left_offsets  = 0;
+	right_offsets = 0;
+	
+	encoding = PAIRS_ABSOLUTE;
+}
+
 void StereoBlank::isometric_grid(int &rows, int &cols,
 	int *&xvec, int &vgap, int rep) const
 {
-	int row, col;
-	int i;
+	IsometricGrid grid = isometric_layout(rep);
+	
+	rows = grid.rows;
+	cols = grid.cols;
+	vgap = grid.vgap;
+	
+	xvec = new int[rows * cols];
+	
+	isometric_grid(grid, xvec);
+}
+
+IsometricGrid StereoBlank::isometric_layout(int rep) const {
+	IsometricGrid grid;
 	
 	int background_gap = force_right(0, 0);
-	int gap = background_gap / rep;
-	vgap = (int) (gap * 0.28868);
 	
-	rows = height / vgap;
-	cols = width / gap;
+	grid.rep  = rep;
+	grid.gap  = rep > 0 ? background_gap / rep : 0;
+	grid.vgap = (int) (grid.gap * 0.28868);
 	
-	xvec = new int[rows * cols];
+	if (grid.gap <= 0 || grid.vgap <= 0) {
+		grid.rows = 0;
+		grid.cols = 0;
+		return grid;
+	}
 	
-	int *ring = new int[rep];
+	grid.rows = height / grid.vgap;
+	grid.cols = width / grid.gap;
 	
-	for (row=0; row<rows; row++) {
-		int offset = (row%2 == 0 ? 0 : gap/2);
-		for (i=0; i<rep; i++) {
-			ring[i] = offset + gap*i;
-		}
-		
-		int y = row * vgap;
+	return grid;
+}
+
+struct grid_job {
+	const StereoBlank *blank;
+	const IsometricGrid *grid;
+	int *xvec;
+};
+
+// Rows are independent: each restarts the ring.
+static void grid_rows(void *arg, int begin, int end) {
+	grid_job *job = (grid_job*) arg;
+	int row, slot;
+	
+	const IsometricGrid &grid = *job->grid;
+	
+	for (row=begin; row<end; row++)
+	for (slot=0; slot<grid.rep && slot<grid.cols; slot++) {
+		IsometricStrand strand(*job->blank, grid, row, slot);
 		
-		for (col=0; col<cols; col++) {
-			int x = ring[col%rep];
-			xvec[col + row*cols] = x;
-			
-			int next = force_right(x, y);
-			if (next < 0) next = x + gap;
-			
-			ring[col%rep] = next;
+		for (; !strand.done(); strand.next()) {
+			job->xvec[strand.col + row*grid.cols] = strand.x;
 		}
 	}
+}
+
+void StereoBlank::isometric_grid(const IsometricGrid &grid,
+	int *xvec) const
+{
+	grid_job job;
+	
+	job.blank = this;
+	job.grid  = &grid;
+	job.xvec  = xvec;
+	
+	grid_pool->run(grid.rows, grid_rows, &job);
+}
+
+// --------------------------------------------
+
+IsometricStrand::IsometricStrand(const StereoBlank &_blank,
+	const IsometricGrid &_grid, int row, int slot) :
+	blank(_blank),
+	grid(_grid)
+{
+	int offset = (row%2 == 0 ? 0 : grid.gap/2);
+	
+	col = slot;
+	x   = offset + grid.gap*slot;
+	y   = row * grid.vgap;
+}
+
+void IsometricStrand::next() {
+	int pair_x = blank.force_right(x, y);
 	
-	delete[] ring;
+	x    = pair_x < 0 ? x + grid.gap : pair_x;
+	col += grid.rep;
 }
 
 // ------------------------------------------------------
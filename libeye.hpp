@@ -3,16 +3,45 @@
 #define _libeye_hpp 1
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <string>
 #include <ostream>
 
 namespace libeye {
 
+// constexpr needs C++14 for the loops in the point code
+#if __cplusplus >= 201402L
+#define LIBEYE_CONSTEXPR constexpr
+#else
+#define LIBEYE_CONSTEXPR inline
+#endif
+
 // ------------------------------------------------
 // Points
+//
+// Arithmetic on points is lazy: operators build small
+// expression objects and nothing is computed until the
+// whole expression is assigned to a point, in one loop
+// per coordinate. Expressions copy their operands, so
+// one kept in a variable stays valid on its own.
+
+// Base of points and point expressions; E is the
+// derived type.
+template<class E, int N>
+class vexpr {
+	public:
+	
+	LIBEYE_CONSTEXPR const E& self() const {
+		return static_cast<const E&>(*this);
+	}
+	
+	LIBEYE_CONSTEXPR double x() const { return self()[0]; }
+	LIBEYE_CONSTEXPR double y() const { return self()[1]; }
+	LIBEYE_CONSTEXPR double z() const { return self()[2]; }
+};
 
 template<int N>
-class point {
+class point : public vexpr<point<N>, N> {
 	public:
 	
 	// -------------------
@@ -23,48 +52,102 @@ class point {
 	// -------------------
 	// methods
 	
-	point();
-	point(double x, double y, double z);
-	point(double x, double y);
+	LIBEYE_CONSTEXPR point();
+	LIBEYE_CONSTEXPR point(double x, double y, double z);
+	LIBEYE_CONSTEXPR point(double x, double y);
 	
-	double  operator[](size_t i) const { return coords[i]; }
-	double& operator[](size_t i)       { return coords[i]; }
+	template<class E>
+	LIBEYE_CONSTEXPR point(const vexpr<E, N> &e);
 	
-	double& x();
-	double& y();
-	double& z();
+	template<class E>
+	LIBEYE_CONSTEXPR point& operator=(const vexpr<E, N> &e);
 	
-	double x() const;
-	double y() const;
-	double z() const;
+	LIBEYE_CONSTEXPR double  operator[](size_t i) const { return coords[i]; }
+	LIBEYE_CONSTEXPR double& operator[](size_t i)       { return coords[i]; }
+	
+	LIBEYE_CONSTEXPR double& x();
+	LIBEYE_CONSTEXPR double& y();
+	LIBEYE_CONSTEXPR double& z();
+	
+	LIBEYE_CONSTEXPR double x() const;
+	LIBEYE_CONSTEXPR double y() const;
+	LIBEYE_CONSTEXPR double z() const;
 };
 
 typedef point<2> point2;
 typedef point<3> point3;
 
-template<int N>
-std::ostream& operator<<(std::ostream &s, const point<N> &p);
+// Expression nodes
 
-template<int N>
-inline point<N> operator-(const point<N> &p);
+template<class A, int N>
+class vneg : public vexpr<vneg<A, N>, N> {
+	public:
+	A a;
+	
+	LIBEYE_CONSTEXPR vneg(const A &_a) : a(_a) { }
+	LIBEYE_CONSTEXPR double operator[](size_t i) const { return -a[i]; }
+};
 
-template<int N>
-inline point<N> operator-(const point<N> &p1, const point<N> &p2);
+template<class A, class B, int N>
+class vsum : public vexpr<vsum<A, B, N>, N> {
+	public:
+	A a;
+	B b;
+	
+	LIBEYE_CONSTEXPR vsum(const A &_a, const B &_b) : a(_a), b(_b) { }
+	LIBEYE_CONSTEXPR double operator[](size_t i) const { return a[i] + b[i]; }
+};
 
-template<int N>
-inline point<N> operator+(const point<N> &p1, const point<N> &p2);
+template<class A, class B, int N>
+class vdiff : public vexpr<vdiff<A, B, N>, N> {
+	public:
+	A a;
+	B b;
+	
+	LIBEYE_CONSTEXPR vdiff(const A &_a, const B &_b) : a(_a), b(_b) { }
+	LIBEYE_CONSTEXPR double operator[](size_t i) const { return a[i] - b[i]; }
+};
 
-template<int N>
-inline point<N> operator*(const point<N> &p, double k);
+template<class A, int N>
+class vscale : public vexpr<vscale<A, N>, N> {
+	public:
+	A a;
+	double k;
+	
+	LIBEYE_CONSTEXPR vscale(const A &_a, double _k) : a(_a), k(_k) { }
+	LIBEYE_CONSTEXPR double operator[](size_t i) const { return a[i] * k; }
+};
 
-template<int N>
-inline point<N> operator*(double k, const point<N> &p);
+template<class E, int N>
+std::ostream& operator<<(std::ostream &s, const vexpr<E, N> &p);
+
+template<class A, int N>
+LIBEYE_CONSTEXPR vneg<A, N> operator-(const vexpr<A, N> &p);
+
+template<class A, class B, int N>
+LIBEYE_CONSTEXPR vdiff<A, B, N> operator-(const vexpr<A, N> &p1,
+	const vexpr<B, N> &p2);
+
+template<class A, class B, int N>
+LIBEYE_CONSTEXPR vsum<A, B, N> operator+(const vexpr<A, N> &p1,
+	const vexpr<B, N> &p2);
 
-template<int N> double norm(const point<N> &p);
-template<int N> double dist(const point<N> &p1, const point<N> &p2);
+template<class A, int N>
+LIBEYE_CONSTEXPR vscale<A, N> operator*(const vexpr<A, N> &p, double k);
 
-template<int N> double dot(const point<N> &p1, const point<N> &p2);
-point3 cross(const point3 &p1, const point3 &p2);
+template<class A, int N>
+LIBEYE_CONSTEXPR vscale<A, N> operator*(double k, const vexpr<A, N> &p);
+
+template<class A, int N>
+double norm(const vexpr<A, N> &p);
+
+template<class A, class B, int N>
+double dist(const vexpr<A, N> &p1, const vexpr<B, N> &p2);
+
+template<class A, class B, int N>
+LIBEYE_CONSTEXPR double dot(const vexpr<A, N> &p1, const vexpr<B, N> &p2);
+
+LIBEYE_CONSTEXPR point3 cross(const point3 &p1, const point3 &p2);
 
 // ------------------------------------------------
 // Screens
@@ -76,8 +159,12 @@ class Screen {
 	point3 e1;
 	point3 e2;
 	
-	Screen();
-	Screen(const point3 &_origin, const point3 &_e1, const point3 &_e2);
+	LIBEYE_CONSTEXPR Screen() :
+		origin(0, 0, 0), e1(1, 0, 0), e2(0, 1, 0) { }
+	
+	LIBEYE_CONSTEXPR Screen(const point3 &_origin,
+		const point3 &_e1, const point3 &_e2) :
+		origin(_origin), e1(_e1), e2(_e2) { }
 	
 	point3 to_real(const point2 &image) const;
 	point2 project(const point3 &eye, const point3 &p) const;
@@ -93,6 +180,120 @@ class Screen {
 		const point3 &p2, const point3 &normal);
 };
 
+// ------------------------------------------------
+// Depth modes
+
+// What View::buffer holds. Distances need a sqrt per
+// fragment; 1/z, z being the distance from the eye's
+// plane (parallel to the screen), is linear in screen space
+// and orders fragments the same way along each pixel ray.
+enum DepthMode {
+	DEPTH_DISTANCE,    // distance from the eye; nearer is smaller
+	DEPTH_INVERSE_Z    // 1/z; nearer is bigger
+};
+
+// ------------------------------------------------
+// Projectors
+
+// Screen::project for a fixed screen and eye, solved once
+// in closed form so that projecting a point is a handful
+// of dot products and one division.
+class Projector {
+	public:
+	
+	point3 eye;
+	
+	Projector(const Screen &screen, const point3 &_eye);
+	
+	// Returns false for points not in front of the eye.
+	bool project(const point3 &p, double &x, double &y) const;
+	
+	// Projects n points at once, also storing their depth
+	// in the given mode. Points not in front of the eye get
+	// NaN coordinates. The loop has no branches.
+	void project(const point3 *p, size_t n,
+		double *x, double *y, double *depth,
+		DepthMode mode=DEPTH_DISTANCE) const;
+	
+	private:
+	
+	point3 normal;
+	point3 u1;
+	point3 u2;
+	
+	double h;
+	double c1;
+	double c2;
+};
+
+// --------------------------------------------
+// Image output
+
+enum ImageFormat {
+	IMAGE_PGM,
+	IMAGE_PPM,
+	IMAGE_PAM,
+	IMAGE_PNG
+};
+
+struct image_state;
+
+// Writes PGM, PPM, PAM or PNG a band of rows at a time, so an
+// image never has to be in memory at once. Samples are 8 or
+// 16 bits in host order, with 1 (grey), 2 (grey and alpha),
+// 3 (RGB) or 4 (RGBA) per pixel; PGM takes only 1 and PPM
+// only 3. PNG rows are gathered into blocks which are
+// filtered and deflated in parallel as they fill.
+class ImageWriter {
+	public:
+	
+	ImageWriter();
+	~ImageWriter();
+	
+	bool open(const char *path, ImageFormat format, int width,
+		int height, int channels, int bits=8);
+	
+	// Row r of the band starts stride bytes after row r-1
+	bool write_rows(const void *rows, int nrows, size_t stride);
+	
+	// 0xRRGGBB pixels, for 3 channels of 8 bits
+	bool write_rgb(const uint32_t *pixels, int nrows);
+	
+	// Returns false if any row is missing or anything failed
+	// since open. The destructor closes too.
+	bool close();
+	
+	private:
+	
+	image_state *state;
+	
+	// Not copyable
+	ImageWriter(const ImageWriter&);
+	ImageWriter& operator=(const ImageWriter&);
+};
+
+// --------------------------------------------
+// Rectangles
+
+// Inclusive pixel rectangle; empty when x0 > x1.
+class Rect {
+	public:
+	
+	int x0, y0;
+	int x1, y1;
+	
+	Rect();
+	Rect(int _x0, int _y0, int _x1, int _y1);
+	
+	bool empty() const { return x0 > x1 || y0 > y1; }
+	
+	void add(int x, int y);
+	void add(const Rect &r);
+	
+	// Intersection with [0,width) x [0,height)
+	Rect clip(int width, int height) const;
+};
+
 // --------------------------------------------
 
 class View {
@@ -105,15 +306,40 @@ class View {
 	int height;
 	
 	double *buffer;
+	DepthMode depth_mode;
+	
+	// Pixels written by draw calls since the last flatten
+	// or start_frame; start_frame flattens these.
+	Rect drawn;
+	
+	// Pixels whose depth draw calls changed since then, and
+	// those changed in the frame before plus by the flatten
+	// of the last start_frame.
+	Rect dirty;
+	Rect last_dirty;
 	
 	View(size_t _width, size_t _height);
 	View(size_t _width, size_t _height,
 		const Screen &_screen, const point3 &_eye);
 	~View();
 	
+	// Distance from the eye, whatever the depth mode
 	double get(int x, int y) const;
 	double get(const point2 &p) const;
 	
+	// Converts the buffer to the given mode. The eye and
+	// screen must not move while the buffer holds 1/z.
+	void set_depth_mode(DepthMode mode);
+	
+	// Converts the buffer back to distances, in parallel
+	void resolve();
+	
+	// Distance along the ray through pixel (x,y) per unit
+	// of distance from the eye's plane
+	double ray_factor(double x, double y) const;
+	
+	// depth is a distance in every mode
+	
 	// Does not overwrite if bigger
 	void draw(int x, int y, double depth);
 	void draw(const point2 &p, double depth);
@@ -121,20 +347,89 @@ class View {
 	// Always overwrites
 	void set(int x, int y, double depth);
 	
+	// Marks the whole view drawn and changed.
 	void flatten(double depth);
 	
+	// Flattens only r; tracked rectangles are left alone.
+	void flatten(double depth, const Rect &r);
+	
+	// For animation: flattens what was drawn last frame
+	// and starts tracking a new frame. Anything else that
+	// overlapped the old drawing must be redrawn.
+	void start_frame(double depth);
+	
+	// Pixels that may differ from the previous frame
+	Rect changed() const;
+	
+	// Lossless compressed copy of the buffer and its depth
+	// mode. load needs a file of the same size and marks the
+	// whole view dirty. Both return false on any error; load
+	// then leaves the view as it was.
+	bool save(const char *path) const;
+	bool load(const char *path);
+	
+	// 16-bit grey image of the distances, white at near and
+	// black at far
+	bool save_image(const char *path, ImageFormat format,
+		double near, double far) const;
+	
 	void draw_point(const point3 &p);
 	void draw_line(const point3 &p1, const point3 &p2);
 	
+	// Splats n points as discs of the given radius (in
+	// pixels), each at the depth of its point. Projection and
+	// splatting are spread over worker threads.
+	void draw_points(const point3 *pts, size_t n, float radius);
+	
+	// Connected segments p[0]-p[1]-...-p[n-1]; each vertex
+	// is projected once.
+	void draw_polyline(const point3 *p, size_t n);
+	
+	// Segments verts[index[2*i]]-verts[index[2*i+1]] for
+	// i < nlines; each vertex is projected once. Segments
+	// with an index outside [0, nverts) are skipped.
+	void draw_lines(const point3 *verts, size_t nverts,
+		const int *index, size_t nlines);
+	
 	void draw_triangle(const point3 &p1,
 		const point3 &p2, const point3 &p3);
 	
+	// Triangle t is verts[3t], verts[3t+1], verts[3t+2].
+	// Runs of sub-pixel triangles on the same pixel are
+	// merged before the depth test.
+	void draw_triangles(const point3 *verts, size_t ntris);
+	
 	void draw_pgram(const point3 &p,
 		const point3 e1, const point3 e2);
 	
 	point2 stereo_pair(const point3 &eye2, const point2 &p) const;
 	
-	private:
+	protected:
+	
+	// A projected line endpoint. Both q = (p-eye)/w and r = 1/w,
+	// w being the distance from the eye plane, are linear in
+	// screen space, so they can be stepped along the image.
+	struct LineVertex {
+		point2 im;
+		point3 q;
+		double r;
+	};
+	
+	point3 unit_normal() const;
+	
+	// Depth test on a value already in buffer units
+	void plot(int x, int y, double value);
+	
+	// flatten(depth, r), returning the pixels whose value
+	// it changed
+	Rect flatten_area(double depth, const Rect &r);
+	
+	// Buffer value for the point eye + leg
+	double depth_value(const point3 &leg, const point3 &normal) const;
+	
+	void line_vertex(LineVertex &v, const point3 &p,
+		const point3 &normal) const;
+	void scan_line(const LineVertex &v1, const LineVertex &v2);
 	
 	int *miny;
 	int *maxy;
@@ -145,6 +440,161 @@ class View {
 	void start_fill();
 	void add_line(const point2 &im1, const point2 &im2);
 	void end_fill(const Screen &remote);
+	
+	// A pending sub-pixel triangle: leg from the eye to its
+	// centroid and w = |leg|^2. Clear live to start a run.
+	struct SmallTriangle {
+		int x, y;
+		point3 leg;
+		double w;
+		bool live;
+	};
+	
+	// For triangle p already projected to im, draws it if
+	// it is too small, thin or narrow to fill: as a point if
+	// its image is under a pixel across, otherwise as a line
+	// along its longest edge. Triangles with an unusable
+	// image are dropped. Returns false if it needs filling.
+	// With run, points on the same pixel are merged into it
+	// until end_small.
+	bool draw_small(const point3 *p, const point2 *im,
+		SmallTriangle *run = 0);
+	void end_small(SmallTriangle &run);
+	
+	void draw_one(const point3 *p, SmallTriangle *run);
+	
+	// screen.origin - eye and the eye's distance from the
+	// screen plane, kept by set_depth_mode and load for the
+	// per-pixel ray factor of 1/z buffers
+	point3 ray_base;
+	double ray_h;
+	
+	void keep_rays();
+	double inverse_factor(int x, int y) const;
+	
+	// MultiView's fill job drives the same path per view
+	friend class MultiView;
+};
+
+// --------------------------------------------
+// Screen geometry policies
+//
+// A View whose screen is known at compile time to have a
+// particular shape can do its per-pixel work with inlined
+// scalar formulas instead of linear solves. Each policy is
+// built from a screen and an eye and provides:
+//
+//   bool   project(p, x, y)         like Screen::project
+//   void   plane(normal, d, pl)     set up the plane n.p = d
+//   double depth(pl, x, y)          eye to plane along pixel ray
+//   double inverse_z(pl, x, y)      the same as 1/z
+//   point3 at_depth(x, y, depth)    point on pixel ray
+//   point3 at_inverse_z(x, y, u)    the same from 1/z
+
+// Any screen
+class GeneralGeometry {
+	public:
+	
+	struct Plane {
+		double num;
+		double a, b, c;
+		
+		double inv;    // 1 / (h num)
+	};
+	
+	GeneralGeometry(const Screen &screen, const point3 &eye);
+	
+	bool project(const point3 &p, double &x, double &y) const;
+	void plane(const point3 &normal, double d, Plane &pl) const;
+	double depth(const Plane &pl, double x, double y) const;
+	double inverse_z(const Plane &pl, double x, double y) const;
+	point3 at_depth(double x, double y, double depth) const;
+	point3 at_inverse_z(double x, double y, double u) const;
+	
+	private:
+	
+	Projector projector;
+	
+	point3 eye;
+	point3 base;   // pixel (0,0) minus eye
+	
+	double h;      // eye to screen plane
+	point3 e1;
+	point3 e2;
+	
+	// |ray|^2 = q0 + x q1 + y q2 + x^2 q11 + x y q12 + y^2 q22
+	double q0, q1, q2;
+	double q11, q12, q22;
+};
+
+// Screens with e1 along x and e2 along y, like the one
+// BiView builds. Not checked; use GeneralGeometry for
+// anything else.
+class AxisGeometry {
+	public:
+	
+	struct Plane {
+		double num;
+		double a, b, c;
+		
+		double inv;    // 1 / (h num)
+	};
+	
+	AxisGeometry(const Screen &screen, const point3 &eye);
+	
+	bool project(const point3 &p, double &x, double &y) const;
+	void plane(const point3 &normal, double d, Plane &pl) const;
+	double depth(const Plane &pl, double x, double y) const;
+	double inverse_z(const Plane &pl, double x, double y) const;
+	point3 at_depth(double x, double y, double depth) const;
+	point3 at_inverse_z(double x, double y, double u) const;
+	
+	private:
+	
+	point3 eye;
+	
+	double ox, oy, oz;
+	double sx, sy;
+	
+	// pixel ray is (ax + x sx, ay + y sy, az)
+	double ax, ay, az;
+	
+	double h;      // |az|
+};
+
+// View specialized on a screen geometry policy. The drawing
+// calls and stereo_pair hide View's generic versions.
+template<class Geometry>
+class GeoView : public View {
+	public:
+	
+	GeoView(size_t _width, size_t _height);
+	GeoView(size_t _width, size_t _height,
+		const Screen &_screen, const point3 &_eye);
+	
+	void draw_point(const point3 &p);
+	
+	void draw_triangle(const point3 &p1,
+		const point3 &p2, const point3 &p3);
+	
+	void draw_triangles(const point3 *verts, size_t ntris);
+	
+	void draw_pgram(const point3 &p,
+		const point3 e1, const point3 e2);
+	
+	// Fills a triangle already projected to im1..im3 and
+	// lying in the plane normal.p = d
+	void fill_triangle(const point2 &im1, const point2 &im2,
+		const point2 &im3, const point3 &normal, double d);
+	
+	point2 stereo_pair(const point3 &eye2, const point2 &p) const;
+	
+	// out[x + y*width] = x of the stereo pair, inside r
+	void stereo_pairs(const point3 &eye2, const Rect &r, int *out) const;
+	
+	protected:
+	
+	void draw_one(const point3 *p, SmallTriangle *run);
 };
 
 // --------------------------------------------
@@ -154,8 +604,8 @@ class BiView {
 	
 	// Data
 	
-	View left;
-	View right;
+	GeoView<AxisGeometry> left;
+	GeoView<AxisGeometry> right;
 	
 	int width;
 	int height;
@@ -177,13 +627,25 @@ class BiView {
 	double half_height(double depth);
 	
 	void flatten(double depth);
+	void start_frame(double depth);
+	
+	void set_depth_mode(DepthMode mode);
+	void resolve();
 	
 	void draw_point(const point3 &p);
 	void draw_line(const point3 &p1, const point3 &p2);
 	
+	void draw_points(const point3 *pts, size_t n, float radius);
+	
+	void draw_polyline(const point3 *p, size_t n);
+	void draw_lines(const point3 *verts, size_t nverts,
+		const int *index, size_t nlines);
+	
 	void draw_triangle(const point3 &p1,
 		const point3 &p2, const point3 &p3);
 	
+	void draw_triangles(const point3 *verts, size_t ntris);
+	
 	void draw_pgram(const point3 &p,
 		const point3 e1, const point3 e2);
 	
@@ -193,32 +655,578 @@ class BiView {
 
 // --------------------------------------------
 
+// Generalization of BiView to any number of eyes along a
+// horizontal baseline, for lenticular and autostereoscopic
+// output. All views share BiView's screen, so a point has
+// the same image y in every view and its image x moves
+// linearly with the eye: triangle setup is done once for
+// all views and only the x offsets differ.
+class MultiView {
+	public:
+	
+	// Data
+	
+	int count;
+	GeoView<AxisGeometry> **views;
+	
+	int width;
+	int height;
+	
+	double dpi;
+	
+	double screen_width;
+	double screen_height;
+	
+	double eye_back;
+	double *eye_x;
+	
+	// Methods
+	
+	// count eyes spread evenly over baseline, centered on 0
+	MultiView(int _count, int _width, int _height,
+		double _eye_back, double baseline, double _dpi=72.0);
+	
+	// count eyes at x = _eye_x[i]
+	MultiView(int _count, const double *_eye_x, int _width,
+		int _height, double _eye_back, double _dpi=72.0);
+	
+	~MultiView();
+	
+	void flatten(double depth);
+	
+	void set_depth_mode(DepthMode mode);
+	void resolve();
+	
+	void draw_triangle(const point3 &p1,
+		const point3 &p2, const point3 &p3);
+	
+	// Triangles verts[3*i], verts[3*i+1], verts[3*i+2]. Setup
+	// is shared, then the views are filled in parallel.
+	void draw_triangles(const point3 *verts, size_t ntris);
+	
+	// Image x in every view of what pixel (x,y) of view
+	// `from` shows; xs has count entries.
+	void pairs(int from, int x, int y, double *xs) const;
+	
+	private:
+	
+	void init(const double *_eye_x);
+	
+	// parallel_for job over views; a member to reach View's
+	// sub-pixel triangle path
+	static void fill_views(void *arg, int begin, int end);
+	
+	// Not copyable
+	MultiView(const MultiView&);
+	MultiView& operator=(const MultiView&);
+};
+
+// --------------------------------------------
+
+// Shape of the grid made by StereoBlank::isometric_grid
+class IsometricGrid {
+	public:
+	
+	int rows;
+	int cols;
+	
+	int gap;
+	int vgap;
+	int rep;
+};
+
+class IsometricStrand;
+
+// --------------------------------------------
+
+// Per-configuration tables for building StereoBlank pair
+// buffers from a BiView without any geometry per pixel.
+//
+// With both eyes on one horizontal line, a pixel x whose
+// point is at distance D from its eye pairs with
+//
+//   x + shift - scale[x,y] / D
+//
+// in the other view, where shift is the eye separation in
+// pixels and scale[x,y] is shift times the length of the
+// pixel's ray to the screen. For views holding 1/z it is
+// x + shift - shift * eye_back * (1/z), with no table at all.
+// So the table only depends on the screen, the eyes and
+// the size; build it once and reuse it for every frame.
+class DisparityTable {
+	public:
+	
+	int width;
+	int height;
+	
+	double eye_back;
+	
+	double left_shift;     // left view into the right eye
+	double right_shift;    // right view into the left eye
+	
+	float *left_scale;
+	float *right_scale;
+	
+	DisparityTable(const BiView &biview);
+	~DisparityTable();
+	
+	// Whether this was built for biview's configuration
+	bool matches(const BiView &biview) const;
+	
+	private:
+	
+	point3 left_eye;
+	point3 right_eye;
+	Screen screen;
+	
+	// Not copyable
+	DisparityTable(const DisparityTable&);
+	DisparityTable& operator=(const DisparityTable&);
+};
+
+// --------------------------------------------
+
+// How StereoBlank stores its pairs. The compact forms keep
+// pair_x - x, which is bounded by the largest disparity.
+// The type's minimum value is reserved for pairs more than
+// two pixels outside the row, which no accessor can tell
+// from a missing pair; they decode as a large negative x.
+enum PairEncoding {
+	PAIRS_ABSOLUTE,    // int pair_x
+	PAIRS_OFFSET16,    // int16_t pair_x - x
+	PAIRS_OFFSET8      // int8_t  pair_x - x
+};
+
+class WorkerPool;
+
 class StereoBlank {
 	public:
 	
 	int width;
 	int height;
 	
+	// Null unless encoding is PAIRS_ABSOLUTE
 	int *left_pair_buffer;
 	int *right_pair_buffer;
 	
+	PairEncoding encoding;
+	
 	StereoBlank(int _width, int _height);
 	StereoBlank(const BiView &biview);
+	StereoBlank(const BiView &biview, const DisparityTable &table);
 	StereoBlank(const View &right, const point3 &eye);
 	~StereoBlank();
 	
 	void set_left(const View &left, const point3 &eye);
 	void set_right(const View &right, const point3 &eye);
 	
+	// Recompute only the pairs inside r
+	void set_left(const View &left, const point3 &eye, const Rect &r);
+	void set_right(const View &right, const point3 &eye, const Rect &r);
+	
+	template<class Geometry>
+	void set_left(const GeoView<Geometry> &left,
+		const point3 &eye, const Rect &r);
+	
+	template<class Geometry>
+	void set_right(const GeoView<Geometry> &right,
+		const point3 &eye, const Rect &r);
+	
+	// Recompute the pairs in each view's changed() area
+	void update(const BiView &biview);
+	
+	// Same through a table built for biview, in parallel
+	void update(const BiView &biview, const DisparityTable &table);
+	void set(const BiView &biview, const DisparityTable &table,
+		const Rect &left_area, const Rect &right_area);
+	
 	int get_left(int x, int y) const;
 	int get_right(int x, int y) const;
 	
 	int force_left(int x, int y) const;
 	int force_right(int x, int y) const;
 	
+	// Re-encodes the pairs in the narrowest offset form that
+	// holds them; returns false, changing nothing, if even 16
+	// bits are not enough. Accessors decode transparently.
+	bool compact();
+	
+	// Back to PAIRS_ABSOLUTE. The set/update calls do this
+	// themselves.
+	void expand();
+	
+	// Compressed copy of both pair maps, in any encoding.
+	// load needs a file of the same size and leaves the
+	// pairs PAIRS_ABSOLUTE; on failure it changes nothing.
+	bool save(const char *path) const;
+	bool load(const char *path);
+	
 	// Caller must delete[] xvec
 	void isometric_grid(int &rows, int &cols,
 		int *&xvec, int &vgap, int rep) const;
+	
+	IsometricGrid isometric_layout(int rep) const;
+	
+	// Fills xvec[rows*cols], which the caller owns and can
+	// reuse between frames. Rows are filled in parallel, on
+	// threads the blank keeps between calls.
+	void isometric_grid(const IsometricGrid &grid, int *xvec) const;
+	
+	private:
+	
+	void *left_offsets;
+	void *right_offsets;
+	
+	WorkerPool *grid_pool;
+	
+	void allocate();
+	
+	int left_at(int x, int y) const;
+	int right_at(int x, int y) const;
+	
+	// Not copyable
+	StereoBlank(const StereoBlank&);
+	StereoBlank& operator=(const StereoBlank&);
+};
+
+// --------------------------------------------
+
+// The points of one grid row that share a slot of the
+// repetition ring, i.e. columns slot, slot+rep, ... Each
+// point is found on demand by following force_right, so
+// walking a strand allocates nothing.
+class IsometricStrand {
+	public:
+	
+	IsometricStrand(const StereoBlank &_blank,
+		const IsometricGrid &_grid, int row, int slot);
+	
+	bool done() const { return col >= grid.cols; }
+	void next();
+	
+	int col;
+	int x;
+	int y;
+	
+	private:
+	
+	const StereoBlank &blank;
+	IsometricGrid grid;
+};
+
+// --------------------------------------------
+// Patterns
+
+// Base pattern for turning a StereoBlank into an image, in
+// 0xRRGGBB pixels. A random pixel depends only on the seed
+// and its coordinates, through a counter-based hash, so rows
+// are made in parallel and a seed gives the same pattern
+// every time.
+class Pattern {
+	public:
+	
+	int width;
+	int height;
+	
+	uint32_t *pixels;
+	
+	Pattern(int _width, int _height);
+	~Pattern();
+	
+	// Each pixel picks uniformly from palette[ncolors]
+	void random_dots(uint32_t seed, const uint32_t *palette,
+		int ncolors);
+	
+	// White with probability density, otherwise black
+	void random_dots(uint32_t seed, double density);
+	
+	// texture[tw*th] stretched over each gap by 2*vgap cell,
+	// repeating with the isometric_grid lattice's starting
+	// points: those of even rows land on the texture's top
+	// left corner and those of odd rows, gap/2 over and vgap
+	// down, on its centre.
+	// Strand points after the first follow force_right, that
+	// is the depth, and land wherever it puts them.
+	void texture_tiles(const uint32_t *texture, int tw, int th,
+		const IsometricGrid &grid);
+	
+	// As 8-bit RGB; not IMAGE_PGM
+	bool save(const char *path, ImageFormat format) const;
+	
+	private:
+	
+	// Not copyable
+	Pattern(const Pattern&);
+	Pattern& operator=(const Pattern&);
+};
+
+// --------------------------------------------
+// Meshes
+
+// Triangle mesh with float coordinates. Binary STL and the
+// indexed format below are memory mapped and read in place;
+// vertices are turned into point3s only as each triangle is
+// drawn. OBJ text is parsed in parallel chunks.
+//
+// Indexed format, little-endian:
+//
+//   char     magic[8]         "LEYEMSH1"
+//   uint32_t nverts, ntris
+//   float    verts[3*nverts]  x, y, z
+//   uint32_t index[3*ntris]
+class Mesh {
+	public:
+	
+	size_t nverts;
+	size_t ntris;
+	
+	Mesh();
+	~Mesh();
+	
+	// All return false, leaving the mesh empty, if the file
+	// cannot be read or is malformed.
+	bool load_stl(const char *path);
+	bool load_mesh(const char *path);
+	bool load_obj(const char *path);
+	
+	// By extension: .stl, .obj, anything else as indexed
+	bool load(const char *path);
+	
+	// Writes the indexed format
+	bool save_mesh(const char *path) const;
+	
+	void clear();
+	
+	point3 vertex(size_t i) const;
+	void triangle(size_t t, point3 &p1, point3 &p2, point3 &p3) const;
+	
+	// Any of View, GeoView, BiView or MultiView, through
+	// draw_triangles in blocks
+	template<class Target>
+	void draw(Target &target) const;
+	
+	private:
+	
+	// Vertex i is the 3 little-endian floats at
+	//   vbase + (i/3)*tstride + (i%3)*12
+	// i.e. packed, but for STL's per-triangle records. They
+	// may be unaligned.
+	const char *vbase;
+	size_t tstride;
+	
+	// 3 uint32s per triangle, little-endian and maybe
+	// unaligned like the vertices. Null means triangle t is
+	// vertices 3t, 3t+1, 3t+2.
+	const char *index;
+	
+	void *map;
+	size_t map_size;
+	
+	float *own_verts;
+	uint32_t *own_index;
+	
+	bool map_file(const char *path);
+	
+	// Not copyable
+	Mesh(const Mesh&);
+	Mesh& operator=(const Mesh&);
+};
+
+// --------------------------------------------
+// Frame pipeline
+
+// What FramePipeline calls for each frame. render runs on
+// the thread that called run(), output on a thread of its
+// own; each sees frames one at a time and in order.
+class FrameStages {
+	public:
+	
+	virtual ~FrameStages() { }
+	
+	// Draw frame into biview, which is recycled from an
+	// earlier frame: flatten it first. Return false when
+	// there are no more frames; biview is then discarded.
+	virtual bool render(BiView &biview, int frame) = 0;
+	
+	// Use the finished frame. Both are recycled as soon as
+	// this returns.
+	virtual void output(const BiView &biview,
+		const StereoBlank &blank, int frame) = 0;
+};
+
+// Runs rendering of frame n+1, building the StereoBlank of
+// frame n and output of frame n-1 at the same time. Frames
+// move between the stages through bounded queues of
+// preallocated BiView/StereoBlank slots, so nothing is
+// allocated per frame.
+class FramePipeline {
+	public:
+	
+	int width;
+	int height;
+	
+	// Number of frames in flight; at least 3 to keep every
+	// stage busy.
+	int depth;
+	
+	// Statistics of the last run(), in seconds
+	int    frames;
+	double frames_per_second;
+	double render_latency;    // mean time in each stage
+	double link_latency;
+	double output_latency;
+	double frame_latency;     // mean render start to output end
+	
+	FramePipeline(int _width, int _height, double eye_back,
+		double eye_sep, double dpi=72.0, int _depth=3);
+	~FramePipeline();
+	
+	// Returns once render has returned false and every
+	// frame before it has been output.
+	void run(FrameStages &stages);
+	
+	private:
+	
+	BiView **views;
+	StereoBlank **blanks;
+	DisparityTable *table;
+	
+	// Not copyable
+	FramePipeline(const FramePipeline&);
+	FramePipeline& operator=(const FramePipeline&);
+};
+
+// --------------------------------------------
+// Render server
+//
+// A long-running process keeps BiView, StereoBlank and
+// DisparityTable sets warm for the configurations it has
+// seen and renders jobs sent by RenderClients over a Unix
+// domain socket. Queued jobs with the same configuration are
+// rendered as one batch on one set; jobs that also share the
+// scene are rendered once. Results are written into shared
+// memory that the client owns, laid out as
+//
+//   double  left_depth[width*height]
+//   double  right_depth[width*height]
+//   int32_t left_pairs[width*height]
+//   int32_t right_pairs[width*height]
+//
+// Depths are distances; pairs are as in StereoBlank.
+
+// Sent over the socket as is
+struct RenderJob {
+	char mesh[256];     // absolute path for Mesh::load
+	char shm[64];       // name for shm_open
+	
+	int32_t width;
+	int32_t height;
+	
+	double eye_back;
+	double eye_sep;
+	double dpi;
+	
+	double background;  // depth to flatten to
+};
+
+size_t render_result_size(int width, int height);
+
+// Largest width*height a server will render
+const size_t render_max_pixels = (size_t) 1 << 24;
+
+struct RenderStats {
+	uint64_t jobs;
+	uint64_t batches;
+	uint64_t failed;
+	
+	int32_t queue_depth;    // jobs waiting now
+	int32_t pools;          // warm configurations
+	
+	// Means over all jobs, in seconds
+	double queue_latency;
+	double render_latency;
+};
+
+struct server_state;
+
+class RenderServer {
+	public:
+	
+	// Keeps at most pools configurations warm, and no more
+	// than about pool_memory bytes of them, dropping the least
+	// recently used. Jobs over render_max_pixels, or too big
+	// to allocate, fail on their own.
+	RenderServer(const char *socket_path, int pools=4,
+		size_t pool_memory=(size_t) 1 << 30);
+	~RenderServer();
+	
+	// Listens and serves from threads of its own; returns
+	// false if the socket cannot be bound. An existing file
+	// at the path is only replaced if it is a socket nobody
+	// listens on. The socket is mode 0600 and only clients
+	// of the same user are served.
+	bool start();
+	
+	// Fails queued jobs, disconnects clients and removes the
+	// socket. The destructor does this too.
+	void stop();
+	
+	RenderStats stats() const;
+	
+	private:
+	
+	server_state *state;
+	
+	// Not copyable
+	RenderServer(const RenderServer&);
+	RenderServer& operator=(const RenderServer&);
+};
+
+class RenderClient {
+	public:
+	
+	// Results of the last render(), valid until the next
+	// one or close()
+	int width;
+	int height;
+	
+	const double *left_depth;
+	const double *right_depth;
+	const int32_t *left_pairs;
+	const int32_t *right_pairs;
+	
+	// Seconds the last job waited and rendered
+	double queue_latency;
+	double render_latency;
+	
+	RenderClient();
+	~RenderClient();
+	
+	bool connect(const char *socket_path);
+	void close();
+	
+	// Blocks until the server is done. mesh is resolved to
+	// an absolute path first. The shared memory is kept and
+	// reused while it is big enough.
+	bool render(const char *mesh, int _width, int _height,
+		double eye_back, double eye_sep, double dpi,
+		double background);
+	
+	bool stats(RenderStats &out);
+	
+	private:
+	
+	int fd;
+	
+	char shm_name[64];
+	void *map;
+	size_t map_size;
+	
+	bool request(const void *req, size_t size, void *reply);
+	
+	// Not copyable
+	RenderClient(const RenderClient&);
+	RenderClient& operator=(const RenderClient&);
 };
 
 // --------------------------------------------
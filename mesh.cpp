@@ -0,0 +1,550 @@
+#include "libeye.hpp"
+
+#include "parallel.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace libeye {
+
+// ------------------------------------------------------
+// Mesh
+//
+// Vertices and indices are little-endian, in files and in
+// memory alike, so mapped files are read in place on any host.
+
+static inline uint32_t get_u32(const char *p) {
+	const unsigned char *u = (const unsigned char*) p;
+	
+	return (uint32_t) u[0] | (uint32_t) u[1] << 8
+		| (uint32_t) u[2] << 16 | (uint32_t) u[3] << 24;
+}
+
+static inline float get_float(const char *p) {
+	uint32_t bits = get_u32(p);
+	float f;
+	
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static inline void put_u32(void *p, uint32_t v) {
+	unsigned char *u = (unsigned char*) p;
+	
+	u[0] = (unsigned char) v;
+	u[1] = (unsigned char) (v >> 8);
+	u[2] = (unsigned char) (v >> 16);
+	u[3] = (unsigned char) (v >> 24);
+}
+
+static inline void put_float(void *p, float f) {
+	uint32_t bits;
+	
+	memcpy(&bits, &f, sizeof(bits));
+	put_u32(p, bits);
+}
+
+Mesh::Mesh() {
+	nverts    = 0;
+	ntris     = 0;
+	vbase     = 0;
+	tstride   = 36;
+	index     = 0;
+	map       = 0;
+	map_size  = 0;
+	own_verts = 0;
+	own_index = 0;
+}
+
+Mesh::~Mesh() {
+	clear();
+}
+
+void Mesh::clear() {
+	if (map != 0) munmap(map, map_size);
+	
+	free(own_verts);
+	free(own_index);
+	
+	nverts    = 0;
+	ntris     = 0;
+	vbase     = 0;
+	tstride   = 36;
+	index     = 0;
+	map       = 0;
+	map_size  = 0;
+	own_verts = 0;
+	own_index = 0;
+}
+
+point3 Mesh::vertex(size_t i) const {
+	const char *p = vbase + (i/3)*tstride + (i%3)*12;
+	
+	return point3(get_float(p), get_float(p + 4), get_float(p + 8));
+}
+
+void Mesh::triangle(size_t t, point3 &p1, point3 &p2, point3 &p3) const {
+	if (index != 0) {
+		p1 = vertex(get_u32(index + 12*t));
+		p2 = vertex(get_u32(index + 12*t + 4));
+		p3 = vertex(get_u32(index + 12*t + 8));
+	}
+	else {
+		p1 = vertex(3*t);
+		p2 = vertex(3*t + 1);
+		p3 = vertex(3*t + 2);
+	}
+}
+
+bool Mesh::map_file(const char *path) {
+	struct stat st;
+	
+	clear();
+	
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	
+	map_size = st.st_size;
+	map = mmap(0, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	
+	close(fd);
+	
+	if (map == MAP_FAILED) {
+		map = 0;
+		map_size = 0;
+		return false;
+	}
+	
+	return true;
+}
+
+// ----------------
+// Binary STL: 80 byte header, uint32 count, then 50 byte
+// records of normal, three vertices and a uint16.
+
+bool Mesh::load_stl(const char *path) {
+	if (!map_file(path)) return false;
+	
+	const char *data = (const char*) map;
+	
+	if (map_size < 84) {
+		clear();
+		return false;
+	}
+	
+	size_t n = get_u32(data + 80);
+	
+	if (n > (map_size - 84) / 50) {
+		clear();
+		return false;
+	}
+	
+	ntris   = n;
+	nverts  = 3 * n;
+	vbase   = data + 84 + 12;
+	tstride = 50;
+	
+	madvise(map, map_size, MADV_SEQUENTIAL);
+	
+	return true;
+}
+
+// ----------------
+// Indexed binary
+
+static const char mesh_magic[8] = { 'L','E','Y','E','M','S','H','1' };
+
+bool Mesh::load_mesh(const char *path) {
+	size_t i;
+	
+	if (!map_file(path)) return false;
+	
+	const char *data = (const char*) map;
+	
+	if (map_size < 16 || memcmp(data, mesh_magic, 8) != 0) {
+		clear();
+		return false;
+	}
+	
+	size_t nv = get_u32(data + 8);
+	size_t nt = get_u32(data + 12);
+	
+	// Divided, as 12*n can wrap a 32-bit size_t
+	if (nv > (map_size - 16) / 12 || nt > (map_size - 16 - 12*nv) / 12) {
+		clear();
+		return false;
+	}
+	
+	nverts = nv;
+	ntris  = nt;
+	vbase  = data + 16;
+	index  = data + 16 + 12*nv;
+	
+	for (i=0; i<3*ntris; i++) {
+		if (get_u32(index + 4*i) >= nverts) {
+			clear();
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+bool Mesh::save_mesh(const char *path) const {
+	size_t i, t;
+	
+	FILE *f = fopen(path, "wb");
+	if (f == 0) return false;
+	
+	unsigned char counts[8];
+	
+	put_u32(counts,     (uint32_t) nverts);
+	put_u32(counts + 4, (uint32_t) ntris);
+	
+	bool ok = fwrite(mesh_magic, 8, 1, f) == 1
+		&& fwrite(counts, sizeof(counts), 1, f) == 1;
+	
+	for (i=0; ok && i<nverts; i++) {
+		ok = fwrite(vbase + (i/3)*tstride + (i%3)*12, 12, 1, f) == 1;
+	}
+	
+	for (t=0; ok && t<ntris; t++) {
+		unsigned char tri[12];
+		
+		for (i=0; i<3; i++) {
+			put_u32(tri + 4*i, index != 0 ? get_u32(index + 12*t + 4*i)
+				: (uint32_t) (3*t + i));
+		}
+		
+		ok = fwrite(tri, sizeof(tri), 1, f) == 1;
+	}
+	
+	return fclose(f) == 0 && ok;
+}
+
+// ----------------
+// OBJ
+//
+// The file is cut into one chunk per worker at line breaks.
+// A first parallel pass counts vertices and triangles per
+// chunk, which places every chunk in the output arrays; a
+// second parses into place. Only v and f lines are used;
+// polygons are fanned into triangles.
+
+struct obj_chunk {
+	const char *begin;
+	const char *end;
+	
+	size_t nverts;
+	size_t ntris;
+	
+	size_t first_vert;
+	size_t first_tri;
+	
+	bool ok;
+};
+
+struct obj_job {
+	obj_chunk *chunks;
+	
+	float *verts;
+	uint32_t *index;
+	
+	size_t nverts;
+	
+	bool parse;
+};
+
+static inline bool obj_space(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *obj_skip_space(const char *p, const char *end) {
+	while (p < end && obj_space(*p)) p++;
+	return p;
+}
+
+static const char *obj_next_line(const char *p, const char *end) {
+	while (p < end && *p != '\n') p++;
+	return p < end ? p + 1 : end;
+}
+
+// Bounded number parsers; the mapping is not terminated.
+static bool obj_float(const char *&p, const char *end, float &out) {
+	double sign = 1, value = 0, scale = 1;
+	bool digits = false;
+	
+	if (p < end && (*p == '-' || *p == '+')) {
+		if (*p == '-') sign = -1;
+		p++;
+	}
+	
+	while (p < end && *p >= '0' && *p <= '9') {
+		value = value*10 + (*p++ - '0');
+		digits = true;
+	}
+	
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && *p >= '0' && *p <= '9') {
+			value = value*10 + (*p++ - '0');
+			scale *= 10;
+			digits = true;
+		}
+	}
+	
+	if (!digits) return false;
+	
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int esign = 1, exp = 0;
+		p++;
+		
+		if (p < end && (*p == '-' || *p == '+')) {
+			if (*p == '-') esign = -1;
+			p++;
+		}
+		
+		while (p < end && *p >= '0' && *p <= '9') {
+			if (exp < 400) exp = exp*10 + (*p - '0');
+			p++;
+		}
+		
+		double e = 1, base = 10;
+		for (; exp > 0; exp >>= 1, base *= base) {
+			if (exp & 1) e *= base;
+		}
+		
+		if (esign > 0) value *= e;
+		else           scale *= e;
+	}
+	
+	out = (float) (sign * value / scale);
+	return true;
+}
+
+static bool obj_int(const char *&p, const char *end, long &out) {
+	long sign = 1, value = 0;
+	
+	if (p < end && *p == '-') {
+		sign = -1;
+		p++;
+	}
+	
+	if (!(p < end && *p >= '0' && *p <= '9')) return false;
+	
+	while (p < end && *p >= '0' && *p <= '9') {
+		value = value*10 + (*p++ - '0');
+	}
+	
+	out = sign * value;
+	return true;
+}
+
+static void obj_chunk_pass(obj_job *job, obj_chunk &c) {
+	const char *p = c.begin;
+	const char *end = c.end;
+	
+	size_t nv = 0, nt = 0;
+	
+	c.ok = true;
+	
+	while (p < end) {
+		p = obj_skip_space(p, end);
+		
+		if (end - p >= 2 && p[0] == 'v' && obj_space(p[1])) {
+			float v[3];
+			int k;
+			
+			p++;
+			for (k=0; k<3; k++) {
+				p = obj_skip_space(p, end);
+				if (!obj_float(p, end, v[k])) c.ok = false;
+			}
+			
+			if (job->parse) {
+				float *out = job->verts + 3*(c.first_vert + nv);
+				
+				for (k=0; k<3; k++) put_float(out + k, v[k]);
+			}
+			nv++;
+		}
+		else if (end - p >= 2 && p[0] == 'f' && obj_space(p[1])) {
+			long first = 0, prev = 0;
+			int corners = 0;
+			
+			p++;
+			for (;;) {
+				long idx;
+				
+				p = obj_skip_space(p, end);
+				if (!obj_int(p, end, idx)) break;
+				
+				// Skip /vt/vn
+				while (p < end && !obj_space(*p) && *p != '\n') p++;
+				
+				// 1-based, or relative to the last vertex so far
+				idx = idx > 0 ? idx - 1 : (long) (c.first_vert + nv) + idx;
+				
+				if (corners >= 2) {
+					if (job->parse) {
+						uint32_t *tri = job->index + 3*(c.first_tri + nt);
+						put_u32(tri,     (uint32_t) first);
+						put_u32(tri + 1, (uint32_t) prev);
+						put_u32(tri + 2, (uint32_t) idx);
+						
+						if (first < 0 || prev < 0 || idx < 0
+							|| (size_t) idx >= job->nverts
+							|| (size_t) first >= job->nverts
+							|| (size_t) prev >= job->nverts)
+							c.ok = false;
+					}
+					nt++;
+				}
+				else if (corners == 0) {
+					first = idx;
+				}
+				
+				prev = idx;
+				corners++;
+			}
+		}
+		
+		p = obj_next_line(p, end);
+	}
+	
+	c.nverts = nv;
+	c.ntris  = nt;
+}
+
+static void obj_chunks(void *arg, int begin, int end) {
+	obj_job *job = (obj_job*) arg;
+	int i;
+	
+	for (i=begin; i<end; i++) {
+		obj_chunk_pass(job, job->chunks[i]);
+	}
+}
+
+bool Mesh::load_obj(const char *path) {
+	int i;
+	
+	if (!map_file(path)) return false;
+	
+	const char *data = (const char*) map;
+	const char *end  = data + map_size;
+	
+	int nchunks = worker_count();
+	obj_chunk *chunks = new obj_chunk[nchunks];
+	
+	const char *p = data;
+	
+	for (i=0; i<nchunks; i++) {
+		const char *cut = data + map_size * (i+1) / nchunks;
+		
+		if (cut < p) cut = p;
+		if (i < nchunks-1) cut = obj_next_line(cut, end);
+		else               cut = end;
+		
+		chunks[i].begin = p;
+		chunks[i].end   = cut;
+		chunks[i].first_vert = 0;
+		chunks[i].first_tri  = 0;
+		
+		p = cut;
+	}
+	
+	obj_job job;
+	
+	job.chunks = chunks;
+	job.verts  = 0;
+	job.index  = 0;
+	job.nverts = 0;
+	job.parse  = false;
+	
+	parallel_for(nchunks, obj_chunks, &job);
+	
+	size_t nv = 0, nt = 0;
+	
+	for (i=0; i<nchunks; i++) {
+		chunks[i].first_vert = nv;
+		chunks[i].first_tri  = nt;
+		
+		nv += chunks[i].nverts;
+		nt += chunks[i].ntris;
+	}
+	
+	// Every v line takes at least 7 bytes and every triangle
+	// at least 2, so bigger counts mean a miscount, and the
+	// indices must fit in 32 bits
+	bool ok = nv <= map_size / 7 && nt <= map_size / 2
+		&& nv <= 0xffffffffu && nt <= ((size_t) -1) / 12;
+	
+	job.verts = 0;
+	job.index = 0;
+	
+	if (ok) {
+		job.verts = (float*) malloc(sizeof(float) * 3 * (nv ? nv : 1));
+		job.index = (uint32_t*) malloc(sizeof(uint32_t) * 3 * (nt ? nt : 1));
+		
+		ok = job.verts != 0 && job.index != 0;
+	}
+	
+	if (ok) {
+		job.nverts = nv;
+		job.parse  = true;
+		
+		parallel_for(nchunks, obj_chunks, &job);
+		
+		for (i=0; i<nchunks; i++) {
+			if (!chunks[i].ok) ok = false;
+		}
+	}
+	
+	delete[] chunks;
+	
+	// The text is not needed any more
+	clear();
+	
+	if (!ok) {
+		free(job.verts);
+		free(job.index);
+		return false;
+	}
+	
+	own_verts = job.verts;
+	own_index = job.index;
+	
+	nverts = nv;
+	ntris  = nt;
+	vbase  = (const char*) own_verts;
+	index  = (const char*) own_index;
+	
+	return true;
+}
+
+// ----------------
+
+bool Mesh::load(const char *path) {
+	size_t len = strlen(path);
+	
+	if (len >= 4 && strcasecmp(path + len - 4, ".stl") == 0)
+		return load_stl(path);
+	
+	if (len >= 4 && strcasecmp(path + len - 4, ".obj") == 0)
+		return load_obj(path);
+	
+	return load_mesh(path);
+}
+
+// ------------------------------------------------------
+
+} /* namespace libeye */
@@ -0,0 +1,305 @@
+#include "libeye.hpp"
+
+#include "parallel.hpp"
+#include <cmath>
+
+namespace libeye {
+
+// ------------------------------------------------------
+// MultiView
+
+MultiView::MultiView(int _count, int _width, int _height,
+	double _eye_back, double baseline, double _dpi)
+{
+	int i;
+	
+	this->count    = _count;
+	this->width    = _width;
+	this->height   = _height;
+	this->eye_back = _eye_back;
+	this->dpi      = _dpi;
+	
+	double *xs = new double[count];
+	
+	for (i=0; i<count; i++) {
+		xs[i] = count > 1 ? baseline * ((double) i / (count-1) - 0.5) : 0;
+	}
+	
+	init(xs);
+	
+	delete[] xs;
+}
+
+MultiView::MultiView(int _count, const double *_eye_x, int _width,
+	int _height, double _eye_back, double _dpi)
+{
+	this->count    = _count;
+	this->width    = _width;
+	this->height   = _height;
+	this->eye_back = _eye_back;
+	this->dpi      = _dpi;
+	
+	init(_eye_x);
+}
+
+// Same screen as BiView
+void MultiView::init(const double *_eye_x) {
+	int i;
+	
+	double scale = 1 / dpi;
+	
+	screen_width  = width  * scale;
+	screen_height = height * scale;
+	
+	point3 origin(-screen_width/2, screen_height/2, 0);
+	point3 e1(scale, 0, 0);
+	point3 e2(0, -scale, 0);
+	
+	Screen screen(origin, e1, e2);
+	
+	eye_x = new double[count];
+	views = new GeoView<AxisGeometry>*[count];
+	
+	for (i=0; i<count; i++) {
+		eye_x[i] = _eye_x[i];
+		
+		views[i] = new GeoView<AxisGeometry>(width, height,
+			screen, point3(eye_x[i], 0, -eye_back));
+	}
+}
+
+MultiView::~MultiView() {
+	int i;
+	
+	for (i=0; i<count; i++) {
+		delete views[i];
+	}
+	
+	delete[] views;
+	delete[] eye_x;
+}
+
+// ------------------------------------------------------
+// Shared triangle setup
+//
+// With the eye at (ex, 0, -eye_back) and t = eye_back / (z +
+// eye_back), a point projects to
+//
+//   x = (t px + (1-t) ex - ox) / sx  =  a + k ex
+//   y = (t py - oy) / sy
+//
+// so each vertex needs t, y, a and k once for all views.
+
+struct multi_tri {
+	const point3 *p;
+	
+	double y[3];
+	double a[3];
+	double k[3];
+	
+	point3 normal;
+	double d;
+	
+	bool skip;
+};
+
+struct multi_job {
+	MultiView *mv;
+	
+	const point3 *verts;
+	multi_tri *tris;
+	int ntris;
+	
+	double depth;
+};
+
+static void multi_setup(const MultiView *mv,
+	const point3 *p, multi_tri &tri)
+{
+	int i;
+	
+	const Screen &screen = mv->views[0]->screen;
+	
+	tri.p = p;
+	
+	double ox = screen.origin.x();
+	double oy = screen.origin.y();
+	double sx = screen.e1.x();
+	double sy = screen.e2.y();
+	
+	tri.normal = cross(p[1] - p[0], p[2] - p[0]);
+	tri.d      = dot(tri.normal, p[0]);
+	tri.skip   = dot(tri.normal, tri.normal) == 0;
+	
+	bool above = true;
+	bool below = true;
+	
+	for (i=0; i<3; i++) {
+		double t = mv->eye_back / (p[i].z() + mv->eye_back);
+		if (!(t > 0)) tri.skip = true;
+		
+		tri.y[i] = (t * p[i].y() - oy) / sy;
+		tri.a[i] = (t * p[i].x() - ox) / sx;
+		tri.k[i] = (1 - t) / sx;
+		
+		if (tri.y[i] >= 0)          above = false;
+		if (tri.y[i] < mv->height)  below = false;
+	}
+	
+	// Off the top or bottom of the screen in every view
+	if (above || below) tri.skip = true;
+}
+
+// Image of tri in view, false if it misses the view
+static bool multi_project(const MultiView *mv, int view,
+	const multi_tri &tri, point2 *im)
+{
+	int i;
+	
+	if (tri.skip) return false;
+	
+	double ex = mv->eye_x[view];
+	
+	bool left  = true;
+	bool right = true;
+	
+	for (i=0; i<3; i++) {
+		im[i] = point2(tri.a[i] + tri.k[i] * ex, tri.y[i]);
+		
+		if (im[i].x() >= 0)         left  = false;
+		if (im[i].x() < mv->width)  right = false;
+	}
+	
+	return !(left || right);
+}
+
+static void multi_setup_range(void *arg, int begin, int end) {
+	multi_job *job = (multi_job*) arg;
+	int i;
+	
+	for (i=begin; i<end; i++) {
+		multi_setup(job->mv, job->verts + 3*i, job->tris[i]);
+	}
+}
+
+void MultiView::fill_views(void *arg, int begin, int end) {
+	multi_job *job = (multi_job*) arg;
+	int v, i;
+	point2 im[3];
+	
+	for (v=begin; v<end; v++) {
+		GeoView<AxisGeometry> *view = job->mv->views[v];
+		
+		View::SmallTriangle run;
+		run.live = false;
+		
+		for (i=0; i<job->ntris; i++) {
+			const multi_tri &tri = job->tris[i];
+			
+			if (!multi_project(job->mv, v, tri, im)) continue;
+			if (view->draw_small(tri.p, im, &run))  continue;
+			
+			view->fill_triangle(im[0], im[1], im[2], tri.normal, tri.d);
+		}
+		
+		view->end_small(run);
+	}
+}
+
+static void multi_flatten(void *arg, int begin, int end) {
+	multi_job *job = (multi_job*) arg;
+	int v;
+	
+	for (v=begin; v<end; v++) {
+		job->mv->views[v]->flatten(job->depth);
+	}
+}
+
+// ------------------------------------------------------
+
+void MultiView::flatten(double depth) {
+	multi_job job;
+	
+	job.mv    = this;
+	job.depth = depth;
+	
+	parallel_for(count, multi_flatten, &job);
+}
+
+void MultiView::set_depth_mode(DepthMode mode) {
+	int v;
+	
+	for (v=0; v<count; v++) {
+		views[v]->set_depth_mode(mode);
+	}
+}
+
+void MultiView::resolve() {
+	set_depth_mode(DEPTH_DISTANCE);
+}
+
+void MultiView::draw_triangle(const point3 &p1,
+	const point3 &p2, const point3 &p3)
+{
+	point3 p[3] = { p1, p2, p3 };
+	multi_tri tri;
+	multi_job job;
+	
+	multi_setup(this, p, tri);
+	
+	job.mv    = this;
+	job.verts = p;
+	job.tris  = &tri;
+	job.ntris = 1;
+	
+	fill_views(&job, 0, count);
+}
+
+void MultiView::draw_triangles(const point3 *verts, size_t ntris) {
+	const int block = 1 << 16;
+	
+	multi_job job;
+	
+	job.mv   = this;
+	job.tris = new multi_tri[block];
+	
+	while (ntris > 0) {
+		job.verts = verts;
+		job.ntris = ntris < (size_t) block ? (int) ntris : block;
+		
+		parallel_for(job.ntris, multi_setup_range, &job);
+		parallel_for(count, fill_views, &job);
+		
+		verts += 3 * job.ntris;
+		ntris -= job.ntris;
+	}
+	
+	delete[] job.tris;
+}
+
+void MultiView::pairs(int from, int x, int y, double *xs) const {
+	int j;
+	
+	const View &view = *views[from];
+	AxisGeometry geom(view.screen, view.eye);
+	
+	point3 far = geom.at_depth(x, y, view.get(x, y));
+	
+	double sx = view.screen.e1.x();
+	double t  = eye_back / (far.z() + eye_back);
+	double k  = (1 - t) / sx;
+	
+	// Image x in view `from`, then step along the baseline
+	double at = (t * far.x() + (1-t) * eye_x[from]
+		- view.screen.origin.x()) / sx;
+	
+	xs[0] = at + k * (eye_x[0] - eye_x[from]);
+	
+	for (j=1; j<count; j++) {
+		xs[j] = xs[j-1] + k * (eye_x[j] - eye_x[j-1]);
+	}
+}
+
+// ------------------------------------------------------
+
+} /* namespace libeye */
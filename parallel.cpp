@@ -0,0 +1,265 @@
+#include "parallel.hpp"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <cstdlib>
+
+namespace libeye {
+
+// ------------------------------------------------------
+
+struct parallel_chunk {
+	void (*fn)(void *arg, int begin, int end);
+	void *arg;
+	
+	int begin;
+	int end;
+};
+
+static void *parallel_entry(void *data) {
+	parallel_chunk *chunk = (parallel_chunk*) data;
+	
+	chunk->fn(chunk->arg, chunk->begin, chunk->end);
+	
+	return 0;
+}
+
+int worker_count() {
+	const char *env = getenv("LIBEYE_THREADS");
+	
+	if (env != 0 && atoi(env) > 0)
+		return atoi(env);
+	
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	return n > 0 ? (int) n : 1;
+}
+
+void parallel_for(int n,
+	void (*fn)(void *arg, int begin, int end), void *arg)
+{
+	int i;
+	
+	if (n <= 0) return;
+	
+	int workers = worker_count();
+	if (workers > n) workers = n;
+	
+	if (workers == 1) {
+		fn(arg, 0, n);
+		return;
+	}
+	
+	parallel_chunk *chunks = new parallel_chunk[workers];
+	pthread_t *threads = new pthread_t[workers];
+	bool *started = new bool[workers];
+	
+	for (i=0; i<workers; i++) {
+		chunks[i].fn    = fn;
+		chunks[i].arg   = arg;
+		chunks[i].begin = (int) ((long long) n * i / workers);
+		chunks[i].end   = (int) ((long long) n * (i+1) / workers);
+	}
+	
+	// Chunk 0 runs on the calling thread.
+	for (i=1; i<workers; i++) {
+		started[i] = pthread_create(&threads[i], 0,
+			parallel_entry, &chunks[i]) == 0;
+		
+		if (!started[i]) parallel_entry(&chunks[i]);
+	}
+	
+	parallel_entry(&chunks[0]);
+	
+	for (i=1; i<workers; i++) {
+		if (started[i]) pthread_join(threads[i], 0);
+	}
+	
+	delete[] chunks;
+	delete[] threads;
+	delete[] started;
+}
+
+// ------------------------------------------------------
+// WorkerPool
+
+struct pool_worker {
+	pool_state *state;
+	int index;
+};
+
+struct pool_state {
+	pthread_mutex_t busy;   // held for a whole run
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	
+	bool started;
+	bool stopping;
+	
+	// Threads besides the caller's, and their chunks; the
+	// caller runs chunks[0] and thread i chunks[i+1].
+	int nthreads;
+	pthread_t *threads;
+	pool_worker *workers;
+	parallel_chunk *chunks;
+	
+	unsigned generation;
+	int pending;
+};
+
+static void *pool_entry(void *data) {
+	pool_worker *worker = (pool_worker*) data;
+	pool_state *state = worker->state;
+	unsigned seen = 0;
+	
+	pthread_mutex_lock(&state->lock);
+	
+	for (;;) {
+		while (state->generation == seen && !state->stopping)
+			pthread_cond_wait(&state->work, &state->lock);
+		
+		if (state->stopping) break;
+		
+		seen = state->generation;
+		parallel_chunk *chunk = &state->chunks[worker->index + 1];
+		
+		pthread_mutex_unlock(&state->lock);
+		
+		if (chunk->begin < chunk->end) parallel_entry(chunk);
+		
+		pthread_mutex_lock(&state->lock);
+		
+		if (--state->pending == 0)
+			pthread_cond_signal(&state->done);
+	}
+	
+	pthread_mutex_unlock(&state->lock);
+	
+	return 0;
+}
+
+WorkerPool::WorkerPool() {
+	state = new pool_state;
+	
+	pthread_mutex_init(&state->busy, 0);
+	pthread_mutex_init(&state->lock, 0);
+	pthread_cond_init(&state->work, 0);
+	pthread_cond_init(&state->done, 0);
+	
+	state->started    = false;
+	state->stopping   = false;
+	state->nthreads   = 0;
+	state->threads    = 0;
+	state->workers    = 0;
+	state->chunks     = 0;
+	state->generation = 0;
+	state->pending    = 0;
+}
+
+WorkerPool::~WorkerPool() {
+	int i;
+	
+	pthread_mutex_lock(&state->lock);
+	state->stopping = true;
+	pthread_cond_broadcast(&state->work);
+	pthread_mutex_unlock(&state->lock);
+	
+	for (i=0; i<state->nthreads; i++) {
+		pthread_join(state->threads[i], 0);
+	}
+	
+	delete[] state->threads;
+	delete[] state->workers;
+	delete[] state->chunks;
+	
+	pthread_mutex_destroy(&state->busy);
+	pthread_mutex_destroy(&state->lock);
+	pthread_cond_destroy(&state->work);
+	pthread_cond_destroy(&state->done);
+	
+	delete state;
+}
+
+// Called with busy held. Threads that fail to start leave
+// the pool smaller.
+void WorkerPool::start() {
+	int i;
+	int wanted = worker_count() - 1;
+	
+	state->started = true;
+	state->threads = new pthread_t[wanted];
+	state->workers = new pool_worker[wanted];
+	state->chunks  = new parallel_chunk[wanted + 1];
+	
+	for (i=0; i<wanted; i++) {
+		state->workers[i].state = state;
+		state->workers[i].index = i;
+		
+		if (pthread_create(&state->threads[i], 0,
+			pool_entry, &state->workers[i]) != 0)
+		{
+			break;
+		}
+	}
+	
+	state->nthreads = i;
+}
+
+void WorkerPool::run(int n,
+	void (*fn)(void *arg, int begin, int end), void *arg)
+{
+	int i;
+	
+	if (n <= 0) return;
+	
+	if (pthread_mutex_trylock(&state->busy) != 0) {
+		parallel_for(n, fn, arg);
+		return;
+	}
+	
+	if (!state->started) start();
+	
+	int parts = state->nthreads + 1;
+	if (parts > n) parts = n;
+	
+	for (i=0; i<=state->nthreads; i++) {
+		parallel_chunk &chunk = state->chunks[i];
+		
+		chunk.fn  = fn;
+		chunk.arg = arg;
+		
+		if (i < parts) {
+			chunk.begin = (int) ((long long) n * i / parts);
+			chunk.end   = (int) ((long long) n * (i+1) / parts);
+		}
+		else {
+			chunk.begin = chunk.end = 0;
+		}
+	}
+	
+	if (state->nthreads > 0) {
+		pthread_mutex_lock(&state->lock);
+		state->pending = state->nthreads;
+		state->generation++;
+		pthread_cond_broadcast(&state->work);
+		pthread_mutex_unlock(&state->lock);
+	}
+	
+	parallel_entry(&state->chunks[0]);
+	
+	if (state->nthreads > 0) {
+		pthread_mutex_lock(&state->lock);
+		
+		while (state->pending > 0)
+			pthread_cond_wait(&state->done, &state->lock);
+		
+		pthread_mutex_unlock(&state->lock);
+	}
+	
+	pthread_mutex_unlock(&state->busy);
+}
+
+// ------------------------------------------------------
+
+} /* namespace libeye */
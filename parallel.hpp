@@ -0,0 +1,48 @@
+#ifndef _libeye_parallel_hpp
+#define _libeye_parallel_hpp 1
+
+// Minimal fork/join helper for the parallel engines.
+//
+// Internal header; not installed.
+
+namespace libeye {
+
+// Number of worker threads; LIBEYE_THREADS overrides
+// the number of online processors.
+int worker_count();
+
+// Splits [0, n) into at most worker_count() contiguous
+// chunks and calls fn(arg, begin, end) for each chunk from
+// its own thread. Returns when every chunk is done.
+void parallel_for(int n,
+	void (*fn)(void *arg, int begin, int end), void *arg);
+
+struct pool_state;
+
+// parallel_for for callers that run every frame: the threads
+// are started on the first run and kept until destruction,
+// so later runs neither allocate nor create threads. A run
+// that overlaps another on the same pool goes through
+// parallel_for instead.
+class WorkerPool {
+	public:
+	
+	WorkerPool();
+	~WorkerPool();
+	
+	void run(int n, void (*fn)(void *arg, int begin, int end), void *arg);
+	
+	private:
+	
+	pool_state *state;
+	
+	void start();
+	
+	// Not copyable
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+};
+
+} /* namespace libeye */
+
+#endif /* defined _libeye_parallel_hpp */
@@ -0,0 +1,185 @@
+#include "libeye.hpp"
+
+#include "parallel.hpp"
+
+namespace libeye {
+
+// ------------------------------------------------------
+// Counter-based random numbers
+//
+// A pixel's number is a hash of (seed, y, x), with no state
+// carried from one pixel to the next. The loops below are
+// straight-line 32-bit integer arithmetic for the compiler
+// to vectorize.
+
+static inline uint32_t mix32(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	
+	return x;
+}
+
+static inline uint32_t row_key(uint32_t seed, int y) {
+	return mix32(seed ^ mix32((uint32_t) y + 0x9e3779b9U));
+}
+
+static inline uint32_t pixel_random(uint32_t key, int x) {
+	return mix32(key + (uint32_t) x * 0x9e3779b9U);
+}
+
+// ------------------------------------------------------
+// Pattern
+
+Pattern::Pattern(int _width, int _height) {
+	this->width  = _width;
+	this->height = _height;
+	
+	pixels = new uint32_t[width * height];
+}
+
+Pattern::~Pattern() {
+	delete[] pixels;
+}
+
+struct pattern_job {
+	Pattern *pattern;
+	
+	uint32_t seed;
+	
+	const uint32_t *palette;
+	uint32_t ncolors;
+	
+	uint32_t threshold;
+	
+	// Texture row and column of each cell row and column
+	const uint32_t *texture;
+	int tw;
+	const int *u;
+	const int *v;
+	int cell_w;
+	int cell_h;
+};
+
+static void palette_rows(void *arg, int begin, int end) {
+	pattern_job *job = (pattern_job*) arg;
+	int x, y;
+	
+	int width = job->pattern->width;
+	const uint32_t *palette = job->palette;
+	uint32_t n = job->ncolors;
+	
+	for (y=begin; y<end; y++) {
+		uint32_t *row = job->pattern->pixels + (size_t) y * width;
+		uint32_t key = row_key(job->seed, y);
+		
+		// Multiply-shift for a near-uniform pick without %: no
+		// color is off by more than n/2^32 in probability
+		for (x=0; x<width; x++) {
+			uint32_t r = pixel_random(key, x);
+			row[x] = palette[(uint32_t) (((uint64_t) r * n) >> 32)];
+		}
+	}
+}
+
+static void dot_rows(void *arg, int begin, int end) {
+	pattern_job *job = (pattern_job*) arg;
+	int x, y;
+	
+	int width = job->pattern->width;
+	uint32_t threshold = job->threshold;
+	
+	for (y=begin; y<end; y++) {
+		uint32_t *row = job->pattern->pixels + (size_t) y * width;
+		uint32_t key = row_key(job->seed, y);
+		
+		for (x=0; x<width; x++) {
+			row[x] = pixel_random(key, x) < threshold ? 0xffffffU : 0;
+		}
+	}
+}
+
+static void tile_rows(void *arg, int begin, int end) {
+	pattern_job *job = (pattern_job*) arg;
+	int x, y;
+	
+	int width = job->pattern->width;
+	
+	for (y=begin; y<end; y++) {
+		uint32_t *row = job->pattern->pixels + (size_t) y * width;
+		const uint32_t *tex = job->texture
+			+ (size_t) job->v[y % job->cell_h] * job->tw;
+		
+		int cx = 0;
+		
+		for (x=0; x<width; x++) {
+			row[x] = tex[job->u[cx]];
+			
+			if (++cx == job->cell_w) cx = 0;
+		}
+	}
+}
+
+void Pattern::random_dots(uint32_t seed, const uint32_t *palette,
+	int ncolors)
+{
+	pattern_job job;
+	
+	if (ncolors <= 0) return;
+	
+	job.pattern = this;
+	job.seed    = seed;
+	job.palette = palette;
+	job.ncolors = ncolors;
+	
+	parallel_for(height, palette_rows, &job);
+}
+
+void Pattern::random_dots(uint32_t seed, double density) {
+	pattern_job job;
+	
+	job.pattern = this;
+	job.seed    = seed;
+	
+	if      (density <= 0) job.threshold = 0;
+	else if (density >= 1) job.threshold = 0xffffffffU;
+	else                   job.threshold = (uint32_t) (density * 4294967296.0);
+	
+	parallel_for(height, dot_rows, &job);
+}
+
+void Pattern::texture_tiles(const uint32_t *texture, int tw, int th,
+	const IsometricGrid &grid)
+{
+	int i;
+	pattern_job job;
+	
+	if (tw <= 0 || th <= 0 || grid.gap <= 0 || grid.vgap <= 0)
+		return;
+	
+	job.pattern = this;
+	job.texture = texture;
+	job.tw      = tw;
+	job.cell_w  = grid.gap;
+	job.cell_h  = 2 * grid.vgap;
+	
+	int *u = new int[job.cell_w];
+	int *v = new int[job.cell_h];
+	
+	for (i=0; i<job.cell_w; i++) u[i] = i * tw / job.cell_w;
+	for (i=0; i<job.cell_h; i++) v[i] = i * th / job.cell_h;
+	
+	job.u = u;
+	job.v = v;
+	
+	parallel_for(height, tile_rows, &job);
+	
+	delete[] u;
+	delete[] v;
+}
+
+// ------------------------------------------------------
+
+} /* namespace libeye */
@@ -0,0 +1,683 @@
+#include "libeye.hpp"
+
+#include "parallel.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace libeye {
+
+// ------------------------------------------------------
+// Saved depth and pair maps
+//
+// Both files are, with every integer little-endian:
+//
+//   char     magic[8]            "LEYEDEP1" or "LEYEPAR1"
+//   uint32_t width, height
+//   uint32_t mode                DepthMode, or 0 for pairs
+//   uint32_t nrows
+//   uint64_t offset[nrows + 1]   row r is data[offset[r],
+//                                offset[r+1])
+//   uint8_t  data[]
+//
+// Each row is coded on its own, so rows can be decoded in any
+// order or in parallel. A depth map has height rows; a pair
+// map has the left rows and then the right rows.
+//
+// Everything is a sequence of LEB128 varints of zigzagged
+// signed values.
+//
+// Depth rows: each double's bits are mapped to an integer that
+// orders like the double, and extrapolated from the pixels
+// before it, linearly or quadratically as the row's first
+// varint (1 or 2) says. Distances along a flat surface are
+// curved in x, 1/z values are not, so either can win. The rest
+// of the row is the prediction errors; an error of 0 is
+// followed by the count of further zero errors, which covers
+// flat and evenly sloped runs.
+//
+// Pair rows: runs of equal offset pair - x, as the change in
+// offset from the previous run then the run length minus one.
+// Missing pairs are stored as they are.
+
+static const char depth_magic[8] = { 'L','E','Y','E','D','E','P','1' };
+static const char pairs_magic[8] = { 'L','E','Y','E','P','A','R','1' };
+
+static const size_t header_size = 24;
+
+// Rows are encoded in blocks, each into a buffer of its own
+static const int rows_per_block = 16;
+
+struct row_buffer {
+	unsigned char *data;
+	size_t size;
+	size_t cap;
+};
+
+static void put_byte(row_buffer &b, unsigned char c) {
+	if (b.size == b.cap) {
+		b.cap  = b.cap ? 2*b.cap : 256;
+		b.data = (unsigned char*) realloc(b.data, b.cap);
+	}
+	
+	b.data[b.size++] = c;
+}
+
+static void put_varint(row_buffer &b, uint64_t v) {
+	while (v >= 0x80) {
+		put_byte(b, (unsigned char) (v | 0x80));
+		v >>= 7;
+	}
+	
+	put_byte(b, (unsigned char) v);
+}
+
+static bool get_varint(const unsigned char *&p,
+	const unsigned char *end, uint64_t &v)
+{
+	int shift;
+	
+	v = 0;
+	
+	for (shift=0; shift<64 && p<end; shift+=7) {
+		unsigned char c = *p++;
+		
+		v |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80)) return true;
+	}
+	
+	return false;
+}
+
+static inline uint64_t zigzag(int64_t v) {
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+// Monotonic map between doubles and unsigned integers
+static inline uint64_t depth_order(double d) {
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	
+	return (bits >> 63) ? ~bits : bits | ((uint64_t) 1 << 63);
+}
+
+static inline double depth_unorder(uint64_t o) {
+	uint64_t bits = (o >> 63) ? o & ~((uint64_t) 1 << 63) : ~o;
+	double d;
+	
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+// Header fields, byte by byte so files move between hosts
+static inline void put_le(unsigned char *p, uint64_t v, int n) {
+	int i;
+	
+	for (i=0; i<n; i++) {
+		p[i] = (unsigned char) (v >> 8*i);
+	}
+}
+
+static inline uint64_t get_le(const unsigned char *p, int n) {
+	uint64_t v = 0;
+	int i;
+	
+	for (i=0; i<n; i++) {
+		v |= (uint64_t) p[i] << 8*i;
+	}
+	
+	return v;
+}
+
+// ----------------
+// Row coders
+
+// Extrapolation from the last three values a, b, c at
+// pixel x, linear or quadratic
+static inline uint64_t depth_predict(int order, int x,
+	uint64_t a, uint64_t b, uint64_t c)
+{
+	if (x == 0) return 0;
+	if (x == 1) return a;
+	
+	if (order == 1 || x == 2) return 2*a - b;
+	
+	return 3*a - 3*b + c;
+}
+
+static inline int varint_size(uint64_t v) {
+	int n = 1;
+	
+	for (; v >= 0x80; v >>= 7) n++;
+	
+	return n;
+}
+
+static void encode_depth_row(const double *row, int width, row_buffer &out) {
+	uint64_t a = 0, b = 0, c = 0;
+	int x = 0;
+	
+	// Pick the order that codes the row smaller. Runs are
+	// left out of the estimate.
+	size_t cost[2] = { 0, 0 };
+	
+	for (x=0; x<width; x++) {
+		uint64_t o = depth_order(row[x]);
+		
+		cost[0] += varint_size(zigzag((int64_t) (o - depth_predict(1, x, a, b, c))));
+		cost[1] += varint_size(zigzag((int64_t) (o - depth_predict(2, x, a, b, c))));
+		
+		c = b;
+		b = a;
+		a = o;
+	}
+	
+	int order = cost[1] < cost[0] ? 2 : 1;
+	
+	put_varint(out, order);
+	
+	a = b = c = 0;
+	x = 0;
+	
+	while (x < width) {
+		uint64_t pred = depth_predict(order, x, a, b, c);
+		uint64_t o = depth_order(row[x]);
+		
+		put_varint(out, zigzag((int64_t) (o - pred)));
+		
+		c = b;
+		b = a;
+		a = o;
+		x++;
+		
+		if (o != pred) continue;
+		
+		uint64_t run = 0;
+		
+		while (x < width) {
+			pred = depth_predict(order, x, a, b, c);
+			o = depth_order(row[x]);
+			
+			if (o != pred) break;
+			
+			c = b;
+			b = a;
+			a = o;
+			x++;
+			run++;
+		}
+		
+		put_varint(out, run);
+	}
+}
+
+static bool decode_depth_row(const unsigned char *p,
+	const unsigned char *end, double *row, int width)
+{
+	uint64_t a = 0, b = 0, c = 0;
+	uint64_t v, run, order;
+	int x = 0;
+	
+	if (!get_varint(p, end, order)) return false;
+	if (order != 1 && order != 2)   return false;
+	
+	while (x < width) {
+		if (!get_varint(p, end, v)) return false;
+		
+		uint64_t o = depth_predict(order, x, a, b, c)
+			+ (uint64_t) unzigzag(v);
+		
+		row[x++] = depth_unorder(o);
+		c = b;
+		b = a;
+		a = o;
+		
+		if (v != 0) continue;
+		
+		if (!get_varint(p, end, run)) return false;
+		if (run > (uint64_t) (width - x)) return false;
+		
+		for (; run > 0; run--) {
+			o = depth_predict(order, x, a, b, c);
+			
+			row[x++] = depth_unorder(o);
+			c = b;
+			b = a;
+			a = o;
+		}
+	}
+	
+	return p == end;
+}
+
+static void encode_pair_row(const int *row, int width, row_buffer &out) {
+	int64_t prev = 0;
+	int x = 0;
+	
+	while (x < width) {
+		int64_t offset = (int64_t) row[x] - x;
+		int len = 1;
+		
+		while (x + len < width && (int64_t) row[x+len] - (x+len) == offset) {
+			len++;
+		}
+		
+		put_varint(out, zigzag(offset - prev));
+		put_varint(out, len - 1);
+		
+		prev = offset;
+		x += len;
+	}
+}
+
+static bool decode_pair_row(const unsigned char *p,
+	const unsigned char *end, int *row, int width)
+{
+	int64_t offset = 0;
+	uint64_t v, run;
+	int x = 0;
+	
+	while (x < width) {
+		if (!get_varint(p, end, v))   return false;
+		if (!get_varint(p, end, run)) return false;
+		if (run >= (uint64_t) (width - x)) return false;
+		
+		offset += unzigzag(v);
+		
+		int end_x = x + (int) run + 1;
+		
+		for (; x < end_x; x++) {
+			row[x] = (int) (x + offset);
+		}
+	}
+	
+	return p == end;
+}
+
+// ----------------
+// Row files, the same for depth and pair maps
+
+struct row_job {
+	int width;
+	int nrows;
+	
+	// Row r is at depth_rows[r] or pair_rows[r]
+	const double *const *depth_rows;
+	const int *const *pair_rows;
+	
+	// Encoding puts the length of row r in offsets[r+1]
+	row_buffer *blocks;
+	uint64_t *offsets;
+	
+	// Decoding
+	const unsigned char *data;
+	double **depth_out;
+	int **pair_out;
+	
+	char *failed;
+};
+
+static void encode_blocks(void *arg, int begin, int end) {
+	row_job *job = (row_job*) arg;
+	int i, r;
+	
+	for (i=begin; i<end; i++) {
+		row_buffer &out = job->blocks[i];
+		
+		int last = (i+1) * rows_per_block;
+		if (last > job->nrows) last = job->nrows;
+		
+		for (r=i*rows_per_block; r<last; r++) {
+			size_t start = out.size;
+			
+			if (job->depth_rows != 0)
+				encode_depth_row(job->depth_rows[r], job->width, out);
+			else
+				encode_pair_row(job->pair_rows[r], job->width, out);
+			
+			job->offsets[r+1] = out.size - start;
+		}
+	}
+}
+
+static void decode_rows(void *arg, int begin, int end) {
+	row_job *job = (row_job*) arg;
+	int r;
+	
+	for (r=begin; r<end; r++) {
+		const unsigned char *p   = job->data + job->offsets[r];
+		const unsigned char *lim = job->data + job->offsets[r+1];
+		bool ok;
+		
+		if (job->depth_out != 0)
+			ok = decode_depth_row(p, lim, job->depth_out[r], job->width);
+		else
+			ok = decode_pair_row(p, lim, job->pair_out[r], job->width);
+		
+		job->failed[r] = !ok;
+	}
+}
+
+static bool save_rows(const char *path, const char *magic,
+	int width, int height, uint32_t mode, row_job &job)
+{
+	int i, r;
+	
+	int nblocks = (job.nrows + rows_per_block - 1) / rows_per_block;
+	
+	uint64_t *offsets = new uint64_t[job.nrows + 1];
+	
+	job.width   = width;
+	job.blocks  = new row_buffer[nblocks];
+	job.offsets = offsets;
+	
+	for (i=0; i<nblocks; i++) {
+		job.blocks[i].data = 0;
+		job.blocks[i].size = 0;
+		job.blocks[i].cap  = 0;
+	}
+	
+	parallel_for(nblocks, encode_blocks, &job);
+	
+	// Row lengths to offsets
+	offsets[0] = 0;
+	for (r=0; r<job.nrows; r++) {
+		offsets[r+1] += offsets[r];
+	}
+	
+	size_t table = header_size + 8 * ((size_t) job.nrows + 1);
+	unsigned char *head = new unsigned char[table];
+	
+	memcpy(head, magic, 8);
+	put_le(head + 8,  width,      4);
+	put_le(head + 12, height,     4);
+	put_le(head + 16, mode,       4);
+	put_le(head + 20, job.nrows,  4);
+	
+	for (r=0; r<=job.nrows; r++) {
+		put_le(head + header_size + 8*r, offsets[r], 8);
+	}
+	
+	FILE *f = fopen(path, "wb");
+	bool ok = f != 0;
+	
+	if (ok) {
+		ok = fwrite(head, 1, table, f) == table;
+		
+		for (i=0; ok && i<nblocks; i++) {
+			ok = fwrite(job.blocks[i].data, 1, job.blocks[i].size, f)
+				== job.blocks[i].size;
+		}
+		
+		if (fclose(f) != 0) ok = false;
+	}
+	
+	for (i=0; i<nblocks; i++) {
+		free(job.blocks[i].data);
+	}
+	
+	delete[] job.blocks;
+	delete[] offsets;
+	delete[] head;
+	
+	return ok;
+}
+
+// Reads the whole file and checks its header and offset
+// table; the caller then decodes with decode_rows.
+static unsigned char *read_rows(const char *path, const char *magic,
+	int width, int height, int nrows, uint32_t &mode, row_job &job)
+{
+	int r;
+	
+	FILE *f = fopen(path, "rb");
+	if (f == 0) return 0;
+	
+	long size = -1;
+	
+	if (fseek(f, 0, SEEK_END) == 0) size = ftell(f);
+	
+	size_t table = header_size + 8 * ((size_t) nrows + 1);
+	
+	// A varint is at most 10 bytes, and no coded pixel takes
+	// more than two
+	size_t most = table + (size_t) nrows * (1 + 20 * (size_t) width);
+	
+	if (size < (long) table || (size_t) size > most
+		|| fseek(f, 0, SEEK_SET) != 0)
+	{
+		fclose(f);
+		return 0;
+	}
+	
+	unsigned char *file = (unsigned char*) malloc(size);
+	
+	if (file == 0) {
+		fclose(f);
+		return 0;
+	}
+	
+	bool ok = fread(file, 1, size, f) == (size_t) size;
+	fclose(f);
+	
+	ok = ok && memcmp(file, magic, 8) == 0
+		&& get_le(file + 8,  4) == (uint32_t) width
+		&& get_le(file + 12, 4) == (uint32_t) height
+		&& get_le(file + 20, 4) == (uint32_t) nrows;
+	
+	uint64_t *offsets = new uint64_t[nrows + 1];
+	
+	if (ok) {
+		for (r=0; r<=nrows; r++) {
+			offsets[r] = get_le(file + header_size + 8*r, 8);
+		}
+		
+		ok = offsets[0] == 0 && offsets[nrows] == (uint64_t) size - table;
+		
+		for (r=0; ok && r<nrows; r++) {
+			if (offsets[r] > offsets[r+1]) ok = false;
+		}
+	}
+	
+	if (!ok) {
+		delete[] offsets;
+		free(file);
+		return 0;
+	}
+	
+	mode = (uint32_t) get_le(file + 16, 4);
+	
+	job.width   = width;
+	job.nrows   = nrows;
+	job.data    = file + table;
+	job.offsets = offsets;
+	job.failed  = new char[nrows];
+	
+	return file;
+}
+
+// Decodes and frees what read_rows set up
+static bool finish_rows(unsigned char *file, row_job &job) {
+	int r;
+	bool ok = true;
+	
+	parallel_for(job.nrows, decode_rows, &job);
+	
+	for (r=0; r<job.nrows; r++) {
+		if (job.failed[r]) ok = false;
+	}
+	
+	delete[] job.offsets;
+	delete[] job.failed;
+	free(file);
+	
+	return ok;
+}
+
+static void init_job(row_job &job) {
+	memset(&job, 0, sizeof(job));
+}
+
+// ------------------------------------------------------
+// View
+
+bool View::save(const char *path) const {
+	int r;
+	row_job job;
+	
+	const double **rows = new const double*[height];
+	
+	for (r=0; r<height; r++) {
+		rows[r] = buffer + (size_t) r * width;
+	}
+	
+	init_job(job);
+	job.nrows      = height;
+	job.depth_rows = rows;
+	
+	bool ok = save_rows(path, depth_magic, width, height, depth_mode, job);
+	
+	delete[] rows;
+	
+	return ok;
+}
+
+bool View::load(const char *path) {
+	int r;
+	row_job job;
+	uint32_t mode;
+	
+	init_job(job);
+	
+	unsigned char *file = read_rows(path, depth_magic,
+		width, height, height, mode, job);
+	
+	if (file == 0) return false;
+	
+	double *loaded = new double[width * height];
+	double **rows  = new double*[height];
+	
+	for (r=0; r<height; r++) {
+		rows[r] = loaded + (size_t) r * width;
+	}
+	
+	job.depth_out = rows;
+	
+	bool ok = finish_rows(file, job)
+		&& (mode == DEPTH_DISTANCE || mode == DEPTH_INVERSE_Z);
+	
+	delete[] rows;
+	
+	if (!ok) {
+		delete[] loaded;
+		return false;
+	}
+	
+	delete[] buffer;
+	buffer = loaded;
+	
+	depth_mode = (DepthMode) mode;
+	drawn      = Rect(0, 0, width-1, height-1);
+	dirty      = drawn;
+	
+	keep_rays();
+	
+	return true;
+}
+
+// ------------------------------------------------------
+// StereoBlank
+
+bool StereoBlank::save(const char *path) const {
+	int x, y;
+	row_job job;
+	
+	const int *left  = left_pair_buffer;
+	const int *right = right_pair_buffer;
+	
+	int *decoded = 0;
+	
+	if (encoding != PAIRS_ABSOLUTE) {
+		decoded = new int[2 * width * height];
+		
+		for (y=0; y<height; y++)
+		for (x=0; x<width; x++) {
+			decoded[x + y*width] = left_at(x, y);
+			decoded[x + (y+height)*width] = right_at(x, y);
+		}
+		
+		left  = decoded;
+		right = decoded + width * height;
+	}
+	
+	const int **rows = new const int*[2*height];
+	
+	for (y=0; y<height; y++) {
+		rows[y]        = left  + (size_t) y * width;
+		rows[height+y] = right + (size_t) y * width;
+	}
+	
+	init_job(job);
+	job.nrows     = 2 * height;
+	job.pair_rows = rows;
+	
+	bool ok = save_rows(path, pairs_magic, width, height, 0, job);
+	
+	delete[] rows;
+	delete[] decoded;
+	
+	return ok;
+}
+
+bool StereoBlank::load(const char *path) {
+	int r;
+	row_job job;
+	uint32_t mode;
+	
+	init_job(job);
+	
+	unsigned char *file = read_rows(path, pairs_magic,
+		width, height, 2*height, mode, job);
+	
+	if (file == 0) return false;
+	
+	int *left  = new int[width * height];
+	int *right = new int[width * height];
+	int **rows = new int*[2*height];
+	
+	for (r=0; r<height; r++) {
+		rows[r]        = left  + (size_t) r * width;
+		rows[height+r] = right + (size_t) r * width;
+	}
+	
+	job.pair_out = rows;
+	
+	bool ok = finish_rows(file, job);
+	
+	delete[] rows;
+	
+	if (!ok) {
+		delete[] left;
+		delete[] right;
+		return false;
+	}
+	
+	// Drops any compact encoding
+	expand();
+	
+	delete[] left_pair_buffer;
+	delete[] right_pair_buffer;
+	
+	left_pair_buffer  = left;
+	right_pair_buffer = right;
+	
+	return true;
+}
+
+// ------------------------------------------------------
+
+} /* namespace libeye */
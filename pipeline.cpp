@@ -0,0 +1,298 @@
+#include "libeye.hpp"
+
+#include <pthread.h>
+#include <time.h>
+
+namespace libeye {
+
+// ------------------------------------------------------
+// Queues of slot numbers
+//
+// -1 marks the end of the stream.
+
+struct slot_queue {
+	int *items;
+	int size;
+	int head;
+	int count;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+static void queue_init(slot_queue &q, int size) {
+	q.items = new int[size];
+	q.size  = size;
+	q.head  = 0;
+	q.count = 0;
+	
+	pthread_mutex_init(&q.lock, 0);
+	pthread_cond_init(&q.changed, 0);
+}
+
+static void queue_destroy(slot_queue &q) {
+	delete[] q.items;
+	
+	pthread_mutex_destroy(&q.lock);
+	pthread_cond_destroy(&q.changed);
+}
+
+static void queue_push(slot_queue &q, int item) {
+	pthread_mutex_lock(&q.lock);
+	
+	while (q.count == q.size)
+		pthread_cond_wait(&q.changed, &q.lock);
+	
+	q.items[(q.head + q.count) % q.size] = item;
+	q.count++;
+	
+	pthread_cond_broadcast(&q.changed);
+	pthread_mutex_unlock(&q.lock);
+}
+
+static int queue_pop(slot_queue &q) {
+	pthread_mutex_lock(&q.lock);
+	
+	while (q.count == 0)
+		pthread_cond_wait(&q.changed, &q.lock);
+	
+	int item = q.items[q.head];
+	q.head = (q.head + 1) % q.size;
+	q.count--;
+	
+	pthread_cond_broadcast(&q.changed);
+	pthread_mutex_unlock(&q.lock);
+	
+	return item;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ------------------------------------------------------
+// Stages
+
+struct pipeline_slot {
+	int frame;
+	double started;
+};
+
+struct pipeline_run {
+	FrameStages *stages;
+	
+	BiView **views;
+	StereoBlank **blanks;
+	const DisparityTable *table;
+	
+	pipeline_slot *slots;
+	
+	// free -> render -> linked -> output -> free
+	slot_queue free_slots;
+	slot_queue rendered;
+	slot_queue linked;
+	
+	// Stage busy time, each written by one thread only
+	double render_time;
+	double link_time;
+	double output_time;
+	double frame_time;
+	int frames;
+};
+
+static void link_slot(pipeline_run *run, int slot) {
+	BiView &view = *run->views[slot];
+	Rect all(0, 0, view.width - 1, view.height - 1);
+	
+	double t0 = now();
+	run->blanks[slot]->set(view, *run->table, all, all);
+	run->link_time += now() - t0;
+}
+
+static void output_slot(pipeline_run *run, int slot) {
+	double t0 = now();
+	run->stages->output(*run->views[slot], *run->blanks[slot],
+		run->slots[slot].frame);
+	
+	double t1 = now();
+	run->output_time += t1 - t0;
+	run->frame_time  += t1 - run->slots[slot].started;
+	run->frames++;
+}
+
+static bool render_slot(pipeline_run *run, int slot, int frame) {
+	double t0 = now();
+	
+	run->slots[slot].frame   = frame;
+	run->slots[slot].started = t0;
+	
+	if (!run->stages->render(*run->views[slot], frame))
+		return false;
+	
+	run->render_time += now() - t0;
+	return true;
+}
+
+static void *link_stage(void *arg) {
+	pipeline_run *run = (pipeline_run*) arg;
+	
+	for (;;) {
+		int slot = queue_pop(run->rendered);
+		
+		if (slot < 0) {
+			queue_push(run->linked, -1);
+			return 0;
+		}
+		
+		link_slot(run, slot);
+		queue_push(run->linked, slot);
+	}
+}
+
+static void *output_stage(void *arg) {
+	pipeline_run *run = (pipeline_run*) arg;
+	
+	for (;;) {
+		int slot = queue_pop(run->linked);
+		if (slot < 0) return 0;
+		
+		output_slot(run, slot);
+		queue_push(run->free_slots, slot);
+	}
+}
+
+// ------------------------------------------------------
+// FramePipeline
+
+FramePipeline::FramePipeline(int _width, int _height, double eye_back,
+	double eye_sep, double dpi, int _depth)
+{
+	int i;
+	
+	this->width  = _width;
+	this->height = _height;
+	this->depth  = _depth < 1 ? 1 : _depth;
+	
+	frames            = 0;
+	frames_per_second = 0;
+	render_latency    = 0;
+	link_latency      = 0;
+	output_latency    = 0;
+	frame_latency     = 0;
+	
+	views  = new BiView*[depth];
+	blanks = new StereoBlank*[depth];
+	
+	for (i=0; i<depth; i++) {
+		views[i]  = new BiView(width, height, eye_back, eye_sep, dpi);
+		blanks[i] = new StereoBlank(width, height);
+	}
+	
+	table = new DisparityTable(*views[0]);
+}
+
+FramePipeline::~FramePipeline() {
+	int i;
+	
+	for (i=0; i<depth; i++) {
+		delete views[i];
+		delete blanks[i];
+	}
+	
+	delete[] views;
+	delete[] blanks;
+	delete table;
+}
+
+void FramePipeline::run(FrameStages &stages) {
+	int i;
+	pipeline_run run;
+	pthread_t linker, outputter;
+	
+	// A run with no frames reports zeros, not the last run
+	frames            = 0;
+	frames_per_second = 0;
+	render_latency    = 0;
+	link_latency      = 0;
+	output_latency    = 0;
+	frame_latency     = 0;
+	
+	run.stages = &stages;
+	run.views  = views;
+	run.blanks = blanks;
+	run.table  = table;
+	run.slots  = new pipeline_slot[depth];
+	
+	run.render_time = 0;
+	run.link_time   = 0;
+	run.output_time = 0;
+	run.frame_time  = 0;
+	run.frames      = 0;
+	
+	// One extra place for the end marker
+	queue_init(run.free_slots, depth + 1);
+	queue_init(run.rendered, depth + 1);
+	queue_init(run.linked, depth + 1);
+	
+	for (i=0; i<depth; i++) {
+		queue_push(run.free_slots, i);
+	}
+	
+	double started = now();
+	
+	bool threaded =
+		pthread_create(&linker, 0, link_stage, &run) == 0;
+	
+	if (threaded && pthread_create(&outputter, 0, output_stage, &run) != 0) {
+		queue_push(run.rendered, -1);
+		pthread_join(linker, 0);
+		threaded = false;
+	}
+	
+	if (!threaded) {
+		// Same stages, one after the other
+		for (int frame=0; render_slot(&run, 0, frame); frame++) {
+			link_slot(&run, 0);
+			output_slot(&run, 0);
+		}
+	}
+	else {
+		for (int frame=0; ; frame++) {
+			int slot = queue_pop(run.free_slots);
+			
+			if (!render_slot(&run, slot, frame)) break;
+			
+			queue_push(run.rendered, slot);
+		}
+		
+		queue_push(run.rendered, -1);
+		
+		pthread_join(linker, 0);
+		pthread_join(outputter, 0);
+	}
+	
+	double elapsed = now() - started;
+	
+	frames = run.frames;
+	
+	if (frames > 0) {
+		frames_per_second = elapsed > 0 ? frames / elapsed : 0;
+		render_latency    = run.render_time / frames;
+		link_latency      = run.link_time / frames;
+		output_latency    = run.output_time / frames;
+		frame_latency     = run.frame_time / frames;
+	}
+	
+	queue_destroy(run.free_slots);
+	queue_destroy(run.rendered);
+	queue_destroy(run.linked);
+	
+	delete[] run.slots;
+}
+
+// ------------------------------------------------------
+
+} /* namespace libeye */
@@ -0,0 +1,1011 @@
+#include "libeye.hpp"
+
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+namespace libeye {
+
+// ------------------------------------------------------
+// Protocol
+//
+// Fixed size messages, one reply per request, in order.
+
+enum {
+	REQUEST_RENDER = 1,
+	REQUEST_STATS  = 2
+};
+
+struct server_request {
+	uint32_t kind;
+	RenderJob job;
+};
+
+struct server_reply {
+	int32_t ok;
+	
+	double queue_latency;
+	double render_latency;
+	
+	RenderStats stats;
+};
+
+// Every shm name a RenderClient makes starts with this, and
+// the server writes to no other
+static const char shm_prefix[] = "/libeye-";
+
+size_t render_result_size(int width, int height) {
+	return (size_t) width * height * (2*sizeof(double) + 2*sizeof(int32_t));
+}
+
+static bool read_full(int fd, void *data, size_t size) {
+	char *p = (char*) data;
+	
+	while (size > 0) {
+		ssize_t n = read(fd, p, size);
+		
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		
+		p    += n;
+		size -= n;
+	}
+	
+	return true;
+}
+
+static bool write_full(int fd, const void *data, size_t size) {
+	const char *p = (const char*) data;
+	
+	while (size > 0) {
+		ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		
+		p    += n;
+		size -= n;
+	}
+	
+	return true;
+}
+
+static bool socket_address(const char *path, struct sockaddr_un &addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	
+	if (strlen(path) >= sizeof(addr.sun_path)) return false;
+	
+	strcpy(addr.sun_path, path);
+	return true;
+}
+
+// Whether path may be bound: free, or a socket left by a
+// server that died, which is removed. Anything else, or a
+// socket some server still answers on, is left alone.
+static bool claim_socket(const char *path,
+	const struct sockaddr_un &addr)
+{
+	struct stat st;
+	
+	if (lstat(path, &st) != 0) return errno == ENOENT;
+	if (!S_ISSOCK(st.st_mode)) return false;
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return false;
+	
+	bool stale = connect(fd, (const struct sockaddr*) &addr,
+		sizeof(addr)) != 0 && errno == ECONNREFUSED;
+	
+	close(fd);
+	
+	return stale && unlink(path) == 0;
+}
+
+// Only processes of the server's own user may send jobs, as
+// jobs name files for the server to read and write
+static bool same_user(int fd) {
+	struct ucred cred;
+	socklen_t size = sizeof(cred);
+	
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) != 0)
+		return false;
+	
+	return cred.uid == geteuid();
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ------------------------------------------------------
+// Server state
+
+struct server_job {
+	RenderJob job;
+	
+	double queued;
+	double queue_latency;
+	double render_latency;
+	
+	bool done;
+	bool ok;
+	
+	server_job *next;
+};
+
+// A warm set for one configuration
+struct render_pool {
+	int width;
+	int height;
+	double eye_back;
+	double eye_sep;
+	double dpi;
+	
+	size_t size;
+	
+	BiView *biview;
+	DisparityTable *table;
+	StereoBlank *blank;
+	
+	render_pool *next;
+};
+
+struct server_conn {
+	server_state *state;
+	int fd;
+	
+	server_conn *next;
+};
+
+struct server_state {
+	char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+	int listen_fd;
+	
+	bool running;
+	bool stopping;
+	
+	pthread_t accept_thread;
+	pthread_t render_thread;
+	
+	// Guards everything below but the pools and the mesh,
+	// which only the render thread touches
+	pthread_mutex_t lock;
+	pthread_cond_t work;        // jobs queued, or stopping
+	pthread_cond_t finished;    // jobs done, or a client left
+	
+	server_job *head;
+	server_job *tail;
+	int depth;
+	
+	server_conn *conns;
+	
+	uint64_t jobs;
+	uint64_t batches;
+	uint64_t failed;
+	double queue_total;
+	double render_total;
+	
+	// Most recently used first
+	render_pool *pools;
+	int npools;
+	int max_pools;
+	size_t pool_bytes;
+	size_t max_pool_bytes;
+	
+	// Last scene, reloaded when its path or file changes;
+	// mesh_loads counts the reloads
+	Mesh mesh;
+	char mesh_path[sizeof(((RenderJob*) 0)->mesh)];
+	struct stat mesh_stat;
+	uint64_t mesh_loads;
+	bool mesh_ok;
+};
+
+// ------------------------------------------------------
+// Rendering
+
+static bool same_config(const RenderJob &a, const RenderJob &b) {
+	return a.width == b.width && a.height == b.height
+		&& a.eye_back == b.eye_back
+		&& a.eye_sep  == b.eye_sep
+		&& a.dpi      == b.dpi;
+}
+
+static bool valid_job(RenderJob &job) {
+	job.mesh[sizeof(job.mesh) - 1] = 0;
+	job.shm[sizeof(job.shm) - 1]   = 0;
+	
+	if (strncmp(job.shm, shm_prefix, sizeof(shm_prefix) - 1) != 0
+		|| strchr(job.shm + 1, '/') != 0)
+	{
+		return false;
+	}
+	
+	// The server's working directory is not the client's
+	if (job.mesh[0] != '/') return false;
+	
+	return job.width  > 0 && job.width  <= (1 << 14)
+		&& job.height > 0 && job.height <= (1 << 14)
+		&& (size_t) job.width * job.height <= render_max_pixels
+		&& job.eye_back > 0 && job.eye_back < HUGE_VAL
+		&& job.eye_sep >= 0 && job.eye_sep  < HUGE_VAL
+		&& job.dpi      > 0 && job.dpi      < HUGE_VAL
+		&& job.background == job.background;
+}
+
+// Two depth buffers, two scale tables and two pair buffers
+static size_t pool_size(int width, int height) {
+	return (size_t) width * height
+		* (2*sizeof(double) + 2*sizeof(float) + 2*sizeof(int));
+}
+
+static void free_pool(render_pool *pool) {
+	delete pool->blank;
+	delete pool->table;
+	delete pool->biview;
+	delete pool;
+}
+
+// Drops the least recently used pools until at most keep are
+// left and extra more bytes would fit in the budget
+static void trim_pools(server_state *s, int keep, size_t extra) {
+	render_pool **link;
+	render_pool *pool;
+	
+	for (;;) {
+		int count = 0;
+		
+		for (pool=s->pools; pool!=0; pool=pool->next) count++;
+		
+		if (count == 0 || (count <= keep
+			&& s->pool_bytes + extra <= s->max_pool_bytes))
+		{
+			pthread_mutex_lock(&s->lock);
+			s->npools = count;
+			pthread_mutex_unlock(&s->lock);
+			
+			return;
+		}
+		
+		// Most recently used first, so the last goes
+		for (link=&s->pools; (*link)->next!=0; link=&(*link)->next) { }
+		
+		pool = *link;
+		*link = 0;
+		
+		s->pool_bytes -= pool->size;
+		free_pool(pool);
+	}
+}
+
+// Finds or builds the set for job, moving it to the front;
+// 0 if it cannot be allocated
+static render_pool *find_pool(server_state *s, const RenderJob &job) {
+	render_pool **link;
+	render_pool *pool;
+	
+	for (link=&s->pools; *link!=0; link=&(*link)->next) {
+		pool = *link;
+		
+		if (pool->width == job.width && pool->height == job.height
+			&& pool->eye_back == job.eye_back
+			&& pool->eye_sep  == job.eye_sep
+			&& pool->dpi      == job.dpi)
+		{
+			*link = pool->next;
+			pool->next = s->pools;
+			s->pools = pool;
+			
+			return pool;
+		}
+	}
+	
+	size_t size = pool_size(job.width, job.height);
+	if (size > s->max_pool_bytes) return 0;
+	
+	// Make room first, so the old and new never add up past
+	// the budget
+	trim_pools(s, s->max_pools - 1, size);
+	
+	pool = new (std::nothrow) render_pool;
+	if (pool == 0) return 0;
+	
+	pool->width    = job.width;
+	pool->height   = job.height;
+	pool->eye_back = job.eye_back;
+	pool->eye_sep  = job.eye_sep;
+	pool->dpi      = job.dpi;
+	pool->size     = size;
+	
+	pool->biview = 0;
+	pool->table  = 0;
+	pool->blank  = 0;
+	
+	try {
+		pool->biview = new BiView(job.width, job.height,
+			job.eye_back, job.eye_sep, job.dpi);
+		pool->table  = new DisparityTable(*pool->biview);
+		pool->blank  = new StereoBlank(job.width, job.height);
+	}
+	catch (std::bad_alloc&) {
+		free_pool(pool);
+		return 0;
+	}
+	
+	pool->next = s->pools;
+	s->pools = pool;
+	s->pool_bytes += size;
+	
+	trim_pools(s, s->max_pools, 0);
+	
+	return s->pools;
+}
+
+// Whether a file is still the one that was loaded
+static bool same_file(const struct stat &a, const struct stat &b) {
+	return a.st_dev == b.st_dev && a.st_ino == b.st_ino
+		&& a.st_size == b.st_size
+		&& a.st_mtim.tv_sec  == b.st_mtim.tv_sec
+		&& a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+static bool load_scene(server_state *s, const char *path) {
+	struct stat st;
+	
+	if (stat(path, &st) != 0) return false;
+	
+	if (strcmp(path, s->mesh_path) == 0 && same_file(st, s->mesh_stat))
+		return s->mesh_ok;
+	
+	// Cleared until the load is done, in case it throws
+	s->mesh_path[0] = 0;
+	s->mesh_loads++;
+	
+	s->mesh_ok   = s->mesh.load(path);
+	s->mesh_stat = st;
+	strcpy(s->mesh_path, path);
+	
+	return s->mesh_ok;
+}
+
+static bool write_result(const RenderJob &job, const render_pool *pool) {
+	struct stat st;
+	
+	size_t size = render_result_size(job.width, job.height);
+	size_t n    = (size_t) job.width * job.height;
+	
+	int fd = shm_open(job.shm, O_RDWR, 0);
+	if (fd < 0) return false;
+	
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < size) {
+		close(fd);
+		return false;
+	}
+	
+	void *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	
+	if (map == MAP_FAILED) return false;
+	
+	const BiView &bv = *pool->biview;
+	const StereoBlank &blank = *pool->blank;
+	
+	double *depth  = (double*) map;
+	int32_t *pairs = (int32_t*) (depth + 2*n);
+	
+	memcpy(depth,     bv.left.buffer,  n * sizeof(double));
+	memcpy(depth + n, bv.right.buffer, n * sizeof(double));
+	
+	memcpy(pairs,     blank.left_pair_buffer,  n * sizeof(int32_t));
+	memcpy(pairs + n, blank.right_pair_buffer, n * sizeof(int32_t));
+	
+	munmap(map, size);
+	return true;
+}
+
+// Jobs of one configuration, in queue order
+static void render_batch(server_state *s, server_job *batch) {
+	server_job *job;
+	server_job *drawn = 0;
+	uint64_t drawn_loads = 0;
+	
+	render_pool *pool = find_pool(s, batch->job);
+	
+	if (pool == 0) {
+		for (job=batch; job!=0; job=job->next) {
+			job->queue_latency  = now() - job->queued;
+			job->render_latency = 0;
+			job->ok = false;
+		}
+		
+		return;
+	}
+	
+	Rect all(0, 0, batch->job.width - 1, batch->job.height - 1);
+	
+	for (job=batch; job!=0; job=job->next) {
+		double start = now();
+		
+		job->queue_latency = start - job->queued;
+		
+		// Meshes and the blank allocate as they go
+		try {
+			bool loaded = load_scene(s, job->job.mesh);
+			
+			// The pool still holds the last job's render, if
+			// the mesh file has not changed since
+			bool again = drawn != 0 && loaded
+				&& s->mesh_loads == drawn_loads
+				&& strcmp(drawn->job.mesh, job->job.mesh) == 0
+				&& drawn->job.background == job->job.background;
+			
+			if (!again) {
+				drawn = 0;
+				
+				if (loaded) {
+					pool->biview->flatten(job->job.background);
+					s->mesh.draw(*pool->biview);
+					pool->blank->set(*pool->biview, *pool->table, all, all);
+					
+					drawn = job;
+					drawn_loads = s->mesh_loads;
+				}
+			}
+		}
+		catch (std::bad_alloc&) {
+			drawn = 0;
+		}
+		
+		job->ok = drawn != 0 && write_result(job->job, pool);
+		job->render_latency = now() - start;
+	}
+}
+
+static void *render_thread(void *arg) {
+	server_state *s = (server_state*) arg;
+	server_job *job, **link;
+	
+	pthread_mutex_lock(&s->lock);
+	
+	for (;;) {
+		while (s->head == 0 && !s->stopping)
+			pthread_cond_wait(&s->work, &s->lock);
+		
+		if (s->stopping) break;
+		
+		// Take the first job and every job queued with the
+		// same configuration
+		server_job *batch = s->head;
+		server_job *end   = batch;
+		
+		s->head = batch->next;
+		s->depth--;
+		
+		for (link=&s->head; *link!=0; ) {
+			job = *link;
+			
+			if (same_config(job->job, batch->job)) {
+				*link = job->next;
+				end->next = job;
+				end = job;
+				s->depth--;
+			}
+			else {
+				link = &job->next;
+			}
+		}
+		
+		end->next = 0;
+		
+		s->tail = 0;
+		for (job=s->head; job!=0; job=job->next) s->tail = job;
+		
+		pthread_mutex_unlock(&s->lock);
+		
+		render_batch(s, batch);
+		
+		pthread_mutex_lock(&s->lock);
+		
+		s->batches++;
+		
+		for (job=batch; job!=0; job=job->next) {
+			s->jobs++;
+			if (!job->ok) s->failed++;
+			
+			s->queue_total  += job->queue_latency;
+			s->render_total += job->render_latency;
+			
+			job->done = true;
+		}
+		
+		pthread_cond_broadcast(&s->finished);
+	}
+	
+	// Fail whatever is left
+	for (job=s->head; job!=0; job=job->next) {
+		job->ok   = false;
+		job->done = true;
+	}
+	
+	s->head  = 0;
+	s->tail  = 0;
+	s->depth = 0;
+	
+	pthread_cond_broadcast(&s->finished);
+	pthread_mutex_unlock(&s->lock);
+	
+	return 0;
+}
+
+// ------------------------------------------------------
+// Connections
+
+static void fill_stats(server_state *s, RenderStats &out) {
+	out.jobs        = s->jobs;
+	out.batches     = s->batches;
+	out.failed      = s->failed;
+	out.queue_depth = s->depth;
+	out.pools       = s->npools;
+	
+	out.queue_latency  = s->jobs ? s->queue_total  / s->jobs : 0;
+	out.render_latency = s->jobs ? s->render_total / s->jobs : 0;
+}
+
+static void serve_request(server_state *s, server_request &req,
+	server_reply &reply)
+{
+	memset(&reply, 0, sizeof(reply));
+	
+	if (req.kind == REQUEST_STATS) {
+		pthread_mutex_lock(&s->lock);
+		fill_stats(s, reply.stats);
+		pthread_mutex_unlock(&s->lock);
+		
+		reply.ok = 1;
+		return;
+	}
+	
+	if (req.kind != REQUEST_RENDER || !valid_job(req.job)) return;
+	
+	server_job job;
+	
+	job.job    = req.job;
+	job.queued = now();
+	job.done   = false;
+	job.ok     = false;
+	job.next   = 0;
+	
+	pthread_mutex_lock(&s->lock);
+	
+	if (!s->stopping) {
+		if (s->tail != 0) s->tail->next = &job;
+		else              s->head = &job;
+		
+		s->tail = &job;
+		s->depth++;
+		
+		pthread_cond_signal(&s->work);
+		
+		while (!job.done)
+			pthread_cond_wait(&s->finished, &s->lock);
+	}
+	
+	pthread_mutex_unlock(&s->lock);
+	
+	reply.ok = job.ok;
+	reply.queue_latency  = job.queue_latency;
+	reply.render_latency = job.render_latency;
+}
+
+static void *conn_thread(void *arg) {
+	server_conn *conn = (server_conn*) arg;
+	server_state *s = conn->state;
+	server_conn **link;
+	
+	server_request req;
+	server_reply reply;
+	
+	while (read_full(conn->fd, &req, sizeof(req))) {
+		serve_request(s, req, reply);
+		
+		if (!write_full(conn->fd, &reply, sizeof(reply))) break;
+	}
+	
+	pthread_mutex_lock(&s->lock);
+	
+	for (link=&s->conns; *link!=0; link=&(*link)->next) {
+		if (*link == conn) {
+			*link = conn->next;
+			break;
+		}
+	}
+	
+	close(conn->fd);
+	delete conn;
+	
+	pthread_cond_broadcast(&s->finished);
+	pthread_mutex_unlock(&s->lock);
+	
+	return 0;
+}
+
+static void *accept_thread(void *arg) {
+	server_state *s = (server_state*) arg;
+	pthread_t thread;
+	
+	for (;;) {
+		int fd = accept(s->listen_fd, 0, 0);
+		
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break;
+		}
+		
+		if (!same_user(fd)) {
+			close(fd);
+			continue;
+		}
+		
+		server_conn *conn = new server_conn;
+		conn->state = s;
+		conn->fd    = fd;
+		
+		pthread_mutex_lock(&s->lock);
+		
+		if (s->stopping || pthread_create(&thread, 0, conn_thread, conn) != 0) {
+			pthread_mutex_unlock(&s->lock);
+			close(fd);
+			delete conn;
+			continue;
+		}
+		
+		pthread_detach(thread);
+		
+		conn->next = s->conns;
+		s->conns = conn;
+		
+		pthread_mutex_unlock(&s->lock);
+	}
+	
+	return 0;
+}
+
+// ------------------------------------------------------
+// RenderServer
+
+RenderServer::RenderServer(const char *socket_path, int pools,
+	size_t pool_memory)
+{
+	state = new server_state;
+	
+	state->path[0]   = 0;
+	state->listen_fd = -1;
+	state->running   = false;
+	state->stopping  = false;
+	
+	if (strlen(socket_path) < sizeof(state->path))
+		strcpy(state->path, socket_path);
+	
+	pthread_mutex_init(&state->lock, 0);
+	pthread_cond_init(&state->work, 0);
+	pthread_cond_init(&state->finished, 0);
+	
+	state->head  = 0;
+	state->tail  = 0;
+	state->depth = 0;
+	state->conns = 0;
+	
+	state->jobs         = 0;
+	state->batches      = 0;
+	state->failed       = 0;
+	state->queue_total  = 0;
+	state->render_total = 0;
+	
+	state->pools     = 0;
+	state->npools    = 0;
+	state->max_pools = pools > 0 ? pools : 1;
+	
+	state->pool_bytes     = 0;
+	state->max_pool_bytes = pool_memory;
+	
+	state->mesh_path[0] = 0;
+	state->mesh_loads   = 0;
+	state->mesh_ok      = false;
+}
+
+RenderServer::~RenderServer() {
+	stop();
+	
+	while (state->pools != 0) {
+		render_pool *next = state->pools->next;
+		free_pool(state->pools);
+		state->pools = next;
+	}
+	
+	pthread_mutex_destroy(&state->lock);
+	pthread_cond_destroy(&state->work);
+	pthread_cond_destroy(&state->finished);
+	
+	delete state;
+}
+
+bool RenderServer::start() {
+	struct sockaddr_un addr;
+	
+	if (state->running || !socket_address(state->path, addr)
+		|| !claim_socket(state->path, addr))
+	{
+		return false;
+	}
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return false;
+	
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+		|| chmod(state->path, 0600) != 0
+		|| listen(fd, 64) != 0)
+	{
+		close(fd);
+		return false;
+	}
+	
+	state->listen_fd = fd;
+	state->stopping  = false;
+	
+	if (pthread_create(&state->render_thread, 0, render_thread, state) != 0) {
+		close(fd);
+		unlink(state->path);
+		return false;
+	}
+	
+	if (pthread_create(&state->accept_thread, 0, accept_thread, state) != 0) {
+		pthread_mutex_lock(&state->lock);
+		state->stopping = true;
+		pthread_cond_broadcast(&state->work);
+		pthread_mutex_unlock(&state->lock);
+		
+		pthread_join(state->render_thread, 0);
+		close(fd);
+		unlink(state->path);
+		return false;
+	}
+	
+	state->running = true;
+	return true;
+}
+
+void RenderServer::stop() {
+	server_conn *conn;
+	
+	if (!state->running) return;
+	
+	pthread_mutex_lock(&state->lock);
+	
+	state->stopping = true;
+	pthread_cond_broadcast(&state->work);
+	
+	// Wakes accept() and every connection's read()
+	shutdown(state->listen_fd, SHUT_RDWR);
+	
+	for (conn=state->conns; conn!=0; conn=conn->next) {
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+	
+	pthread_mutex_unlock(&state->lock);
+	
+	pthread_join(state->accept_thread, 0);
+	pthread_join(state->render_thread, 0);
+	
+	pthread_mutex_lock(&state->lock);
+	
+	while (state->conns != 0)
+		pthread_cond_wait(&state->finished, &state->lock);
+	
+	pthread_mutex_unlock(&state->lock);
+	
+	close(state->listen_fd);
+	unlink(state->path);
+	
+	state->listen_fd = -1;
+	state->running   = false;
+}
+
+RenderStats RenderServer::stats() const {
+	RenderStats out;
+	
+	pthread_mutex_lock(&state->lock);
+	fill_stats(state, out);
+	pthread_mutex_unlock(&state->lock);
+	
+	return out;
+}
+
+// ------------------------------------------------------
+// RenderClient
+
+RenderClient::RenderClient() {
+	width  = 0;
+	height = 0;
+	
+	left_depth  = 0;
+	right_depth = 0;
+	left_pairs  = 0;
+	right_pairs = 0;
+	
+	queue_latency  = 0;
+	render_latency = 0;
+	
+	fd          = -1;
+	shm_name[0] = 0;
+	map         = 0;
+	map_size    = 0;
+}
+
+RenderClient::~RenderClient() {
+	close();
+}
+
+bool RenderClient::connect(const char *socket_path) {
+	struct sockaddr_un addr;
+	
+	close();
+	
+	if (!socket_address(socket_path, addr)) return false;
+	
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return false;
+	
+	if (::connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	
+	return true;
+}
+
+void RenderClient::close() {
+	if (map != 0) {
+		munmap(map, map_size);
+		shm_unlink(shm_name);
+	}
+	
+	if (fd >= 0) ::close(fd);
+	
+	fd          = -1;
+	shm_name[0] = 0;
+	map         = 0;
+	map_size    = 0;
+	
+	left_depth  = 0;
+	right_depth = 0;
+	left_pairs  = 0;
+	right_pairs = 0;
+}
+
+bool RenderClient::request(const void *req, size_t size, void *reply) {
+	if (fd < 0) return false;
+	
+	if (!write_full(fd, req, size)
+		|| !read_full(fd, reply, sizeof(server_reply)))
+	{
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	
+	return true;
+}
+
+bool RenderClient::render(const char *mesh, int _width, int _height,
+	double eye_back, double eye_sep, double dpi, double background)
+{
+	static int serial = 0;
+	
+	server_request req;
+	server_reply reply;
+	
+	char path[PATH_MAX];
+	
+	memset(&req, 0, sizeof(req));
+	
+	if (_width <= 0 || _height <= 0) return false;
+	
+	// Resolved here, as the server has a working directory
+	// of its own
+	if (realpath(mesh, path) == 0) return false;
+	if (strlen(path) >= sizeof(req.job.mesh)) return false;
+	
+	size_t size = render_result_size(_width, _height);
+	
+	if (map_size < size) {
+		if (map != 0) {
+			munmap(map, map_size);
+			shm_unlink(shm_name);
+			map = 0;
+		}
+		
+		snprintf(shm_name, sizeof(shm_name), "%s%d-%d",
+			shm_prefix, (int) getpid(), __sync_fetch_and_add(&serial, 1));
+		
+		int shm = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (shm < 0) return false;
+		
+		if (ftruncate(shm, size) == 0) {
+			map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+			if (map == MAP_FAILED) map = 0;
+		}
+		
+		::close(shm);
+		
+		if (map == 0) {
+			shm_unlink(shm_name);
+			map_size = 0;
+			return false;
+		}
+		
+		map_size = size;
+	}
+	
+	req.kind = REQUEST_RENDER;
+	
+	strcpy(req.job.mesh, path);
+	strcpy(req.job.shm, shm_name);
+	
+	req.job.width      = _width;
+	req.job.height     = _height;
+	req.job.eye_back   = eye_back;
+	req.job.eye_sep    = eye_sep;
+	req.job.dpi        = dpi;
+	req.job.background = background;
+	
+	if (!request(&req, sizeof(req), &reply) || !reply.ok) return false;
+	
+	size_t n = (size_t) _width * _height;
+	
+	width  = _width;
+	height = _height;
+	
+	left_depth  = (const double*) map;
+	right_depth = left_depth + n;
+	left_pairs  = (const int32_t*) (right_depth + n);
+	right_pairs = left_pairs + n;
+	
+	queue_latency  = reply.queue_latency;
+	render_latency = reply.render_latency;
+	
+	return true;
+}
+
+bool RenderClient::stats(RenderStats &out) {
+	server_request req;
+	server_reply reply;
+	
+	memset(&req, 0, sizeof(req));
+	req.kind = REQUEST_STATS;
+	
+	if (!request(&req, sizeof(req), &reply) || !reply.ok) return false;
+	
+	out = reply.stats;
+	return true;
+}
+
+// ------------------------------------------------------
+
+} /* namespace libeye */